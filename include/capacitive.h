@@ -4,30 +4,78 @@
 #include <stdint.h> // uint8_t
 #include "circular_buffer.h" // circular_buffer_t
 #include "capacitive_settings.h"
+#include "pin_utils.h" // pin_t
+#include "capacitive_kernels.h" // capacitive_kernel_t
+
+/* Pin resolved once by capacitive_pin_init, reads do not need id_to_pin and port dispatch anymore */
+typedef struct {
+    pin_t pin; // registers and bitmask
+    uint8_t id; // arduino pin id
+    uint8_t port_id; // index of the port, PIN_PORTS_NUM if the pin does not exist
+    uint8_t * enabled_mask; // input bitmask of the port
+    volatile uint8_t * used_mask; // used bitmask of the port (cleared by the discharge timer)
+#ifndef USE_PORT_PARALLEL_READ
+    capacitive_kernel_t kernel; // constant addresses kernel, NULL if the pin has none
+#endif
+} capacitive_pin_t;
 
 // Lenght of a buffer containing SAMPLES_NUM samples
 #define BUF_LEN CIRCULAR_BUFFER_BUF_LEN(SAMPLES_NUM)
 __attribute__((packed))
 struct capacitive_sensor_t {
+#if defined(USE_SLICED_HISTORY)
+    uint8_t index; // Position in the sensors array, the histories are shared (see capacitive.c)
+#elif defined(USE_HISTORY_BUFFER)
+    history_t low_buffer, high_buffer; // Last SAMPLES_NUM readings, one bit each
+#else
     uint8_t low_buffer_data[BUF_LEN];  // Actual buffer where data is stored
     uint8_t high_buffer_data[BUF_LEN]; // Actual buffer where data is stored
     circular_buffer_t low_buffer, high_buffer; // Buffer wrapper
-    uint8_t high_threshold, low_threshold; // between 0 and 255
-    uint8_t released_threshold; // Set on each keypress
-    uint16_t hysteresis_a, hysteresis_b; // Avoid send a double press when actually is only one
+#endif
+    capacitive_threshold_t high_threshold, low_threshold; // between 0 and THRESHOLD_MAX (CHARGE_TIME_MAX with USE_CHARGE_TIME)
+    capacitive_threshold_t released_threshold; // Set on each keypress
+    uint32_t debounce; // capacitive_clock of the last keyrelease, or of the releasing start while pressed
     uint32_t gray_zone; // Time in spent gray zone
+    capacitive_pin_t io; // resolved pin, used by all the reads
     uint8_t pin:6; // pin  Number on which to execute the measurement
     uint8_t to_probe:1; // true if needed to re-calibrate the sensor
     uint8_t pressed:1; // true wether pressed, else false
+    uint8_t locked:1; // true while presses are ignored, after a keyrelease
+    uint8_t releasing:1; // true while the release condition holds, but it is still not a keyrelease
+#ifdef USE_THRESHOLD_TRACKING
+    uint8_t low_step:4, high_step:4; // current tracking step of each threshold, 0 when not tracking
+    uint8_t low_up:1, high_up:1; // tracking direction (1 increasing) of each threshold
+#endif
+#ifdef USE_SPRT
+    int16_t press_llr, release_llr; // log-likelihood ratio of press and release, SPRT_SCALE units
+#endif
+#ifdef USE_ADAPTIVE_WINDOW
+    uint8_t noise; // average of the noisy ticks, in [0 - 255]
+    uint8_t window_shift; // decision window is SAMPLES_NUM >> window_shift readings
+#endif
+#ifdef USE_BASELINE_TRACKING
+    uint32_t baseline; // average charge time of the released pad, 16 fractional bits
+#endif
+#ifdef USE_NOISE_DELTAS
+    sample_ring_data_t noise_data[NOISE_RING_LEN]; // Actual ring where the measures are stored
+    sample_ring_t noise_ring; // Last measures of the released pad, with their mean and variance
+#endif
 };
 
 typedef struct capacitive_sensor_t   capacitive_sensor_t;
 typedef struct capacitive_sensor_t * capacitive_sensor_ptr_t;
 
+#ifndef CAPACITIVE_SENSORS_NUM // A single sensor needs a runtime sensor count
 void capacitive_sensor_init(const capacitive_sensor_ptr_t sensors, const uint8_t pin_id);
+#endif
 void capacitive_sensor_inits(const capacitive_sensor_ptr_t sensors, const uint8_t * const pin_id, const uint8_t num);
 void capacitive_sensor_inits_P(const capacitive_sensor_ptr_t sensors, const uint8_t * const pin_id, const uint8_t num);
 uint32_t capacitive_sensor_pressed(const capacitive_sensor_ptr_t sensors, const uint8_t num);
+#ifdef USE_STREAMING_SAMPLER
+/* Starts filling sensors buffers in background, from Timer 1 compare C interrupt.
+   Call it after the sensors are initialized and Timer 1 is running */
+void capacitive_sampler_start(const capacitive_sensor_ptr_t sensors, const uint8_t num);
+#endif
 
 // -----------------------------------
 // -----   LOW LEVEL FUNCTIONS   -----
@@ -40,10 +88,47 @@ void inint_inputs_P(const uint8_t inputs[], const uint8_t inputs_len);
 /* Should call after each round of capacitive reads (TODO: automatic process?) */
 void discharge_ports(void);
 
+/* Monotonic clock, Timer 3 ticks (cpu clock / 8) since inputs init. Wraps every 2^32 ticks (35 minutes),
+   so compare only differences. Converts microseconds into ticks, rounded up */
+uint32_t capacitive_clock(void);
+#define CAPACITIVE_CLOCK_TICKS(us) ((uint32_t)((double)(us)/1E6 * F_CPU/8.0 + 0.999))
+
+/* Most pins (or reads) handled at once by the functions below, it sizes their scratch arrays (no VLA)
+   Longer calls are split, reads of a pin in different parts do not share the charge */
+#ifdef CAPACITIVE_SENSORS_NUM
+#    define CAPACITIVE_READS_MAX ((2*CAPACITIVE_SENSORS_NUM < 32) ? 2*CAPACITIVE_SENSORS_NUM : 32) // low and high of each sensor
+#else
+#    define CAPACITIVE_READS_MAX ((2*MAX_SENSORS_NUM < 32) ? 2*MAX_SENSORS_NUM : 32)
+#endif
+
+/* Resolves pin id, the result can be used by all the following reads */
+void capacitive_pin_init(capacitive_pin_t * const pin, const uint8_t id);
+
 /* Capacitive read function,
    returns 1 if there is contact, 0 if not, and -1 on errors */
 unsigned char check_port(uint8_t in);
-void set_threshold(uint8_t new_sens);
-uint8_t get_threshold(void);
+unsigned char capacitive_pin_check(const capacitive_pin_t * const pin);
+#ifdef USE_DISCHARGE_CALIBRATION
+/* Measures the discharge time of the pin (untouched), used by all its following reads.
+   Reads the pin many times, call it at init */
+void capacitive_pin_calibrate_discharge(const capacitive_pin_t * const pin);
+#endif
+#ifdef USE_PORT_PARALLEL_READ
+/* Reads all the given pins (at most 32), each one with its own threshold.
+   Bit i of the return value is the result of the read of in[i]
+   A pin may be given more than once (e.g. with two thresholds), reads share the charge.
+   Thresholds closer than ~21 cycles on a port are read exactly by one more charge */
+uint32_t check_ports(const uint8_t in[], const capacitive_threshold_t thresholds[], const uint8_t num);
+uint32_t capacitive_pins_check(const capacitive_pin_t * const pins[], const capacitive_threshold_t thresholds[], const uint8_t num);
+#endif
+#ifdef USE_CHARGE_TIME
+/* Charge time measurement, returns the time (in polling loops) needed
+   by the pin to read 1. Returns CHARGE_TIME_MAX if it did not charge (at most 32 pins) */
+uint8_t measure_port(uint8_t in);
+void measure_ports(const uint8_t in[], uint8_t times[], const uint8_t num);
+void capacitive_pins_measure(const capacitive_pin_t * const pins[], uint8_t times[], const uint8_t num);
+#endif
+void set_threshold(capacitive_threshold_t new_sens);
+capacitive_threshold_t get_threshold(void);
 
 #endif // CAPACITIVE_H defined
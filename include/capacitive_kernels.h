@@ -0,0 +1,81 @@
+#ifndef CAPACITIVE_KERNELS_H
+#define CAPACITIVE_KERNELS_H
+
+#include <stdint.h> // uint8_t
+#include "cpu.h" // registers, delay loops
+#include "pin_utils.h" // PIN_PORT_REG & friends
+
+// Charge window, in cpu cycles (see CAPACITIVE_WINDOW). Single cycle resolution on the whole range
+// With USE_CHARGE_TIME thresholds are measured charge times instead, in the units of the measure
+typedef uint16_t capacitive_threshold_t;
+
+// Reads one pin after 'threshold' cycles, returns 1 if there is contact (same as check_port)
+typedef uint8_t (*capacitive_kernel_t)(capacitive_threshold_t threshold);
+
+// Kernels of the input pins, indexed by pin id (NULL if pin has none). Always stored in flash
+// Defined by CAPACITIVE_KERNELS_TABLE, pins without a kernel use the generic (slower) reading
+extern const capacitive_kernel_t capacitive_kernels[] __attribute__((__progmem__));
+extern const uint8_t capacitive_kernels_len;
+
+// Busy waits exactly cycles + CAPACITIVE_DELAY_OVERHEAD cycles, for any 16 bits value of the
+// operand 'cycles' (a register pair of the "w" class, destroyed). Bits 0 and 1 are waited by two
+// skips (a skipped one word instruction costs 2 cycles, rjmp 1 more, lpm 2 more), the rest by a
+// 4 cycles loop. sbiw + brcc ends on the borrow, so 0 loops are 0 loops (not 65536). Clobbers r0
+#define CAPACITIVE_DELAY_OVERHEAD 11
+#define CAPACITIVE_DELAY_ASM                                                                                        \
+    "sbrc %A[cycles], 0"    "\n\t" /* 2 cycles, 3 if bit 0 is set */                                             \
+    "rjmp .+0"              "\n\t"                                                                                \
+    "sbrc %A[cycles], 1"    "\n\t" /* 2 cycles, 4 if bit 1 is set */                                             \
+    "lpm"                   "\n\t"                                                                                \
+    "lsr %B[cycles]"        "\n\t" /* cycles / 4, 4 cycles */                                                    \
+    "ror %A[cycles]"        "\n\t"                                                                                \
+    "lsr %B[cycles]"        "\n\t"                                                                                \
+    "ror %A[cycles]"        "\n\t"                                                                                \
+    "8: sbiw %[cycles], 1"  "\n\t" /* 4 cycles each, the last (borrow) 3 */                                      \
+    "brcc 8b"               "\n\t"
+
+// Charge window: PORTx is written with 'on' (out, charging starts), then PINx is read (in) after
+// threshold + CAPACITIVE_WINDOW_OFFSET cycles. All the kernels share it, so thresholds are the same
+// on every reading path. The padding lets check_ports read its first snapshot with the same window
+#define CAPACITIVE_WINDOW_OFFSET (CAPACITIVE_DELAY_OVERHEAD + 5)
+#define CAPACITIVE_WINDOW(port_reg, pin_reg, on, threshold, read)                                                   \
+    __asm__ __volatile__ (                                                                                          \
+        "out %[port], %[on]"    "\n\t" /* Capacitor charging starts now */                                        \
+        "rjmp .+0"              "\n\t" /* Padding, 4 cycles (see check_ports) */                                  \
+        "rjmp .+0"              "\n\t"                                                                            \
+        CAPACITIVE_DELAY_ASM                                                                                        \
+        "in %[read], %[pin]"    "\n\t"                                                                            \
+        : [read] "=&r" (read), [cycles] "+w" (threshold)                                                            \
+        : [port] "I" (_SFR_IO_ADDR(port_reg)), [pin] "I" (_SFR_IO_ADDR(pin_reg)), [on] "r" (on)                     \
+        : "r0")
+
+// Reads pin 'id' after 'threshold' cycles, as check_pin, but registers are constants and the
+// whole window is a single asm block, so it does not depend on the optimization level
+// Do not inline it !!! It works because the compiler will not mix its code with the rest
+#define CAPACITIVE_KERNEL(id) CAPACITIVE_KERNEL_(id) // Expands pin names (e.g. INPUT_PIN_UP)
+#define CAPACITIVE_KERNEL_(id)                                                                                      \
+__attribute__((noinline)) static uint8_t capacitive_kernel_ ## id(capacitive_threshold_t threshold) {              \
+    uint8_t read, on;                                                                                               \
+    _MemoryBarrier();                                                                                               \
+    PIN_DDR_REG(id) &= ~PIN_BITMASK(id); /* Make the port an input (connect internal resistor) */                   \
+    on = PIN_PORT_REG(id) | PIN_BITMASK(id); /* Pull-up value, computed before the window */                       \
+    CAPACITIVE_WINDOW(PIN_PORT_REG(id), PIN_PIN_REG(id), on, threshold, read);                                      \
+    _MemoryBarrier(); /* WARNING: Keep the order of the following two */                                            \
+    PIN_PORT_REG(id) &= ~PIN_BITMASK(id); /* wirtes 0 */                                                            \
+    _MemoryBarrier();                                                                                               \
+    PIN_DDR_REG(id) |= PIN_BITMASK(id); /* port is now an output (disconnect internal resistor) */                  \
+    _MemoryBarrier();                                                                                               \
+    return !(read & PIN_BITMASK(id));                                                                               \
+}
+
+#define CAPACITIVE_KERNEL_ENTRY(id) CAPACITIVE_KERNEL_ENTRY_(id)
+#define CAPACITIVE_KERNEL_ENTRY_(id) [id] = &capacitive_kernel_ ## id,
+
+// Defines all the kernels and their table. FOREACH(X) must call X(pin id) once for each input
+// (e.g. INPUTS_FOREACH of config.h). Use it in a single file
+#define CAPACITIVE_KERNELS_TABLE(FOREACH)                                                                           \
+    FOREACH(CAPACITIVE_KERNEL)                                                                                      \
+    const capacitive_kernel_t capacitive_kernels[] __attribute__((__progmem__)) = { FOREACH(CAPACITIVE_KERNEL_ENTRY) }; \
+    const uint8_t capacitive_kernels_len = sizeof(capacitive_kernels)/sizeof(*capacitive_kernels)
+
+#endif // CAPACITIVE_KERNELS_H
@@ -2,39 +2,177 @@
 #define SETTINGS_H
 
 #define START_THRESHOLD   0
-#define DISCHARGE_TIME    10 // in us
+#define THRESHOLD_MAX  1023 // Longest charge window, in cpu cycles (1 cycle steps), in [1 - 65534]
+                            // Calibration searches [0 - THRESHOLD_MAX], raise it for large pads or long cables
+                            // Not with USE_CHARGE_TIME, thresholds are charge times (see CHARGE_TIME_MAX)
+#define DISCHARGE_TIME    10 // in us. Timed by TIMER 3 (free running), do not use it for something else
+                             // A pin read again waits only the discharge time it still needs
 
-// Enable it if you want timing discharge made with timers
-// NOTE: this will take 64 more bytes in RAM
+// Enable it to measure at init, for each pad, the shortest discharge after which its reads do not
+// change (edge threshold moves less than DISCHARGE_TOLERANCE cycles), plus DISCHARGE_MARGIN percent
+// Small pads get far less than DISCHARGE_TIME, so they can be read again sooner
+#define USE_DISCHARGE_CALIBRATION // DISCHARGE_TIME is kept by pads that cannot be measured, or do not settle in DISCHARGE_TIME_MAX
+#define DISCHARGE_TIME_MAX 40 // in us, longest measured discharge (for very large pads), at least DISCHARGE_TIME
+#define DISCHARGE_TOLERANCE 2 // in cpu cycles, threshold shift still considered the same read
+#define DISCHARGE_MARGIN 50 // percent added to the measured discharge
+#define DISCHARGE_CAL_READS 15 // reads per tested discharge, the majority decides (odd number, at most 255)
+
+// Enable it if you want to mark discharged pins as usable from the timer interrupt
+// (without it every read of a recently used pin checks its discharge time)
 #define USE_DISCHARGE_TIMERS // undef to disable this operation
-                             // Timer used is TIMER 3, do not use for something else
-                             // Timer is set to use DISCHARGE_TIME
+
+#define MAX_SENSORS_NUM 8 // Max number of sensors (at most 32), sizes the queue of waiting discharges
+                          // and the bit-sliced histories (the queue handles inefficently each more pin)
+
+// Define it to the number of inputs (see config.h) to build the engine for exactly that many sensors
+// Scratch arrays get a fixed size (no VLA) and the loops over the sensors are unrolled
+#define CAPACITIVE_SENSORS_NUM 4 // comment it to pass the number of sensors at runtime
+#if defined(CAPACITIVE_SENSORS_NUM) && ((CAPACITIVE_SENSORS_NUM < 1) || (CAPACITIVE_SENSORS_NUM > MAX_SENSORS_NUM))
+#   error CAPACITIVE_SENSORS_NUM must be in [1 - MAX_SENSORS_NUM]
+#endif
 
 #ifdef USE_DISCHARGE_TIMERS // If using timers
-#   define MAX_PORT_NUM 4 // This is the max number of ports at the same time
-                          // The code will handle inefficently each more pin waiting for discharge
+#   define DISCHARGE_QUEUE_LEN ((MAX_SENSORS_NUM <= 4) ? 4 : (MAX_SENSORS_NUM <= 8) ? 8 : \
+                                (MAX_SENSORS_NUM <= 16) ? 16 : 32) // Rounded up to a power of 2
+#endif
+
+// Enable it to read all the pins on the same port with a single charge/discharge
+// PINx is read once for each threshold, so a round of readings costs one charge per port
+#define USE_PORT_PARALLEL_READ // undef to read one pin at a time
+                               // NOTE: thresholds closer than ~21 cycles on a port take one more charge
+
+// Enable it to move the threshold of each charge by a small pseudo-random offset (centred on it)
+// A pad between two threshold steps reads 1 with a probability following its charge time, so the
+// window sums resolve a fraction of a step, instead of flipping between gray zone and press
+#define USE_THRESHOLD_DITHER // Ignored with USE_CHARGE_TIME. One offset per charge (per port with parallel reads)
+#define DITHER_BITS 2 // Offsets span 2^DITHER_BITS cycles around the threshold, in [1 - 6]
+
+// Enable it to measure how long each pin takes to charge, instead of reading it at a threshold
+// A single measure gives both the low and the high reading, and calibration uses the measures
+// #define USE_CHARGE_TIME // define to enable charge time measurement
+#define CHARGE_TIME_MAX 255 // Max measured time, in polling loops (must fit in uint8_t)
+
+#ifdef USE_CHARGE_TIME
+// Enable it to time PORTB pins (8-11) with pin change interrupts instead of polling them
+// While pins are charging the CPU sleeps, and other interrupts (i.e. USB) are not blocked
+// #define USE_PCINT_CHARGE_TIME // Timer used is TIMER 0, do not use for something else
+                                 // PORTB times are in cpu cycles rather than polling loops
+#define PCINT_RETRIES 3 // A pin that charges while another interrupt (i.e. USB) runs is timed late,
+                        // so it is measured again. After PCINT_RETRIES late measures the last one is kept
+
+// Enable it to time the pad on INPUT_CAPTURE_PIN with the Timer 1 input capture unit
+// Hardware latches the exact cycle the pad charged, and the CPU sleeps in the meantime
+// #define USE_INPUT_CAPTURE // Timer 1 will count cpu cycles (it also sets Timer 1 prescaler to 1)
+#define INPUT_CAPTURE_PIN 4 // ICP1 (PD4) is the only pin Timer 1 can capture
+                            // to route another pad through it, wire that pad to this pin
+
+// Enable it to follow the untouched charge time of each pad with a slow moving average (baseline),
+// updated only while the pad is released and its measure is not above the low threshold (a foot
+// resting on the pad is not drift). Thresholds are derived from the baseline every tick, so drift
+// (temperature, humidity, foam) is followed and sensors are probed only at init
+#define USE_BASELINE_TRACKING // replaces USE_THRESHOLD_TRACKING
+#define BASELINE_SHIFT 12 // each update weights 1/2^BASELINE_SHIFT
+#define BASELINE_EVERY 64 // one round in BASELINE_EVERY updates it, in [1 - 255]
+                          // time constant is 4096 * 64 measures, ~23 s by default
+#define PRESS_DELTA   12 // high threshold, in polling loops above the baseline
+#define RELEASE_DELTA  6 // low threshold, in polling loops above the baseline (less than PRESS_DELTA)
+                         // with USE_PCINT_CHARGE_TIME, PORTB deltas are in cpu cycles
+
+// Enable it to keep the last measures of each released pad in a sample ring (see circular_buffer.h)
+// When the pad is noisy, PRESS_DELTA widens to NOISE_SIGMAS standard deviations of the measures,
+// and RELEASE_DELTA with it (their ratio is kept). Quiet pads keep the deltas above
+#define USE_NOISE_DELTAS // Requires USE_BASELINE_TRACKING
+#define NOISE_RING_LEN 64 // measures in the ring, bytes of RAM for each sensor
+#define NOISE_SIGMAS 4 // standard deviations below PRESS_DELTA
+#if defined(USE_NOISE_DELTAS) && !defined(USE_BASELINE_TRACKING)
+#   error USE_NOISE_DELTAS widens the baseline deltas, enable USE_BASELINE_TRACKING
+#endif
+#endif
+
+// Enable it to take the readings in background, spread along the whole tick
+// capacitive_sensor_pressed will only read the buffers, that are always up to date
+// #define USE_STREAMING_SAMPLER // Uses TIMER 1 compare C (Timer 1 is the main tick timer)
+#if defined(USE_STREAMING_SAMPLER) && (defined(USE_PCINT_CHARGE_TIME) || defined(USE_INPUT_CAPTURE))
+#   error USE_STREAMING_SAMPLER cannot sleep waiting interrupts, disable USE_PCINT_CHARGE_TIME and USE_INPUT_CAPTURE
 #endif
 
+// Enable it to read, for each sensor, mostly the threshold deciding its next event: the high one
+// while released (next is a press), the low one while pressed (next is a release). Both are read
+// once every STATE_REFRESH_ROUNDS rounds, for calibration and gray zone, and always while tracking
+// Reading one pin at a time it about halves the charges. With USE_PORT_PARALLEL_READ low and high
+// share the charge, so it only saves a snapshot: leave it disabled
+// #define USE_STATE_SAMPLING // Ignored with USE_CHARGE_TIME, a single measure gives both readings
+#define STATE_REFRESH_ROUNDS 4 // Rounds between two readings of the other threshold
+
 // If you don't know what next parameters are leave them as they are
 #define SAMPLES_NUM 32 // Number of samples to take before choosing whether the button is pressed or not
-#define LOW_THRESHOLD  0.90 // must be in [0.00-1.00], choosing parameter
-#define HIGH_THRESHOLD 0.10 // must be in [0.00-1.00], as above
+// Enable it to keep the samples in word shift registers (see history_t) instead of circular buffers
+// SAMPLES_NUM must be HISTORY_LEN (see circular_buffer.h). A press is also accepted when the last
+// HISTORY_FAST_LEN readings are all high, and the whole window is at least half pressed (with USE_SPRT too)
+#define USE_HISTORY_BUFFER
+
+// Enable it to keep the readings of all the sensors in bit-sliced histories (see sliced_history.h)
+// Byte k of a history holds sample k of 8 sensors: pushes, sums and comparisons are done for 8
+// sensors at a time, so 8 or 16 pads cost about as 4. SAMPLES_NUM must be SLICED_HISTORY_LEN
+// #define USE_SLICED_HISTORY // Replaces USE_HISTORY_BUFFER, at most MAX_SENSORS_NUM sensors
+
+// Enable it to decide clean sensors on shorter windows. Each released sensor measures its noise as
+// the share of ticks whose window is NOISE_MARGIN percents past LOW_THRESHOLD or HIGH_THRESHOLD, and
+// decides on its last SAMPLES_NUM >> window_shift readings: the window halves while noise stays
+// below NOISE_CLEAN, and doubles when it goes above NOISE_NOISY. Gray zone alone is no noise, the
+// thresholds are calibrated right there and a clean pad spends about half the ticks in it
+// Sums are scaled to SAMPLES_NUM, so the conditions above keep their percent meaning
+// Only without USE_SPRT: with it, the windows decide nothing but the gray zone
+// #define USE_ADAPTIVE_WINDOW // Requires USE_HISTORY_BUFFER
+#define WINDOW_SHIFT_MAX 2 // Shortest window is SAMPLES_NUM >> WINDOW_SHIFT_MAX readings, in [0 - 3]
+#define NOISE_MARGIN 20 // percent of SAMPLES_NUM, integer, thresholds must stay in [0 - 100]
+#define NOISE_SHIFT 4 // Noise is averaged over about 2^NOISE_SHIFT ticks
+#define NOISE_CLEAN 8 // in [0 - 255], 255 is always noisy
+#define NOISE_NOISY 32 // in [NOISE_CLEAN - 255]
 
-// Next two must be floating point in [0.0 - 1.0]
-#define PRESS_CONDITION    0.80 // Higher will press a key harder
-#define RELEASE_CONDITION  0.80 // Lower will release a key harder
+#if defined(USE_ADAPTIVE_WINDOW) && (defined(USE_SLICED_HISTORY) || !defined(USE_HISTORY_BUFFER))
+#   error USE_ADAPTIVE_WINDOW needs the word histories, enable USE_HISTORY_BUFFER and disable USE_SLICED_HISTORY
+#endif
+#define LOW_THRESHOLD  90 // percent of SAMPLES_NUM, must be integer in [0-100], choosing parameter
+#define HIGH_THRESHOLD 10 // percent of SAMPLES_NUM, must be integer in [0-100], as above
+
+// Next two must be integer percents of SAMPLES_NUM in [0 - 100]
+#define PRESS_CONDITION    80 // Higher will press a key harder
+#define RELEASE_CONDITION  80 // Lower will release a key harder
+
+// Enable it to decide presses and releases with a sequential probability ratio test instead of the
+// window sums: every reading updates a log-likelihood ratio of each sensor, so a clean hit is
+// decided after about 10 readings, while a noisy one waits for more evidence
+// A test restarts when it rejects, and after each press or release. Tests are repeated on every
+// reading at most, so the wrong decisions of a test are sized by SPRT_FALSE_PER_HOUR
+#define USE_SPRT // Hypotheses are the conditions above, against LOW_THRESHOLD and HIGH_THRESHOLD
+#define SPRT_FALSE_PER_HOUR 0.1 // wrong presses (or releases) per hour of each sensor, must be > 0.0
+#define SPRT_READS_PER_SECOND (360.0*SAMPLES_NUM) // SAMPLES_PER_SECOND (see config.h) rounds per second, checked in main.c
+#define SPRT_BETA  0.01 // probability of a missed press or release, must be in (0.0 - 1.0)
+#define SPRT_SCALE 16 // log-likelihood units per nat (fixed point precision)
+
+#if defined(USE_ADAPTIVE_WINDOW) && defined(USE_SPRT)
+#   error USE_ADAPTIVE_WINDOW has no effect with USE_SPRT, disable one of them
+#endif
 
 // Coarse sensibility adjust
 // Set next two to zero to disable the effect
 #define PRESS_THRESHOLD 3 // increase in sensor threshold before keypress
 #define RELEASE_THRESHOLD 0 // same as above for keyrelease (sensor threshold decrease)
 
-#define HYSTERESIS_A 0 // Time to wait after a keyrelease and before sending the succesive
-#define HYSTERESIS_B 0 // Time to wait before keyrelease
+// Enable it to re-calibrate the thresholds after a press or a release a bit at a time, during the
+// following ticks (using the readings of each tick), instead of a full probe that stalls the tick
+#define USE_THRESHOLD_TRACKING // undef to probe again on each press/release
+#define TRACKING_STEP 8 // Max threshold change per tick, in [1-15]. The step halves each time it overshoots
+
+// Debounce, in microseconds, so it does not depend on SAMPLES_PER_SECOND nor on the sampling
+// Each sensor is timed on its own. Set both to zero to disable the effect
+#define PRESS_LOCKOUT_US 0 // Time after a keyrelease when presses are ignored
+#define RELEASE_HOLD_US  0 // Time the release condition must last before the keyrelease
 
 // Auto reset settings, they shouldn't be changed
 // Grayzone is the zone between PRESS and RELEASE condition.
-#define MAX_TIME_IN_GRAYZONE ((uint32_t)1E9) // uinsigned int between 0 and 2^32 -1
+#define MAX_TIME_IN_GRAYZONE 1000000000UL // uinsigned int between 0 and 2^32 -1
                         // After that time in grayzone sensibility is reset and re probed
 #define MAX_PROBE_STEPS ((uint32_t)250) // sometimes probe gets stuck (don't know why).
                         // This forces exit after given number of steps
@@ -32,4 +32,89 @@ void circular_buffer_reset(circular_buffer_ptr_t buf);
 void circular_buffer_push(circular_buffer_ptr_t buf, uint8_t new_data); // pushes new data (popping the old one)
 circular_buffer_sum_t circular_buffer_sum(circular_buffer_const_ptr_t buf); // gets the sum of all the data into the buffer
 
+// History: the last HISTORY_LEN binary samples kept in a shift register (bit 0 is the newest)
+// A push is a shift and an or, sums of the whole history and of the last HISTORY_FAST_LEN samples
+// are kept updating them with the bits that leave each window
+#define HISTORY_LEN 32 // Must be one of 8, 16, 32, 64
+#define HISTORY_FAST_LEN 4 // Short window, in [1 - HISTORY_LEN]
+
+#if HISTORY_LEN == 8
+typedef uint8_t history_word_t;
+#elif HISTORY_LEN == 16
+typedef uint16_t history_word_t;
+#elif HISTORY_LEN == 32
+typedef uint32_t history_word_t;
+#elif HISTORY_LEN == 64
+typedef uint64_t history_word_t;
+#else
+#    error HISTORY_LEN must be one of 8, 16, 32, 64
+#endif
+#if (HISTORY_FAST_LEN < 1) || (HISTORY_FAST_LEN > HISTORY_LEN)
+#    error HISTORY_FAST_LEN must be in [1 - HISTORY_LEN]
+#endif
+
+struct _history_t {
+    history_word_t bits; // one sample per bit, newest in bit 0
+    circular_buffer_sum_t sum; // Sum of all the samples
+    circular_buffer_sum_t fast_sum; // Sum of the last HISTORY_FAST_LEN samples
+};
+
+typedef struct _history_t * history_ptr_t;
+typedef const struct _history_t * history_const_ptr_t;
+typedef struct _history_t history_t[1]; // util name
+
+void history_reset(history_ptr_t hist); // Fills with 50% 1 and 50% zero, as circular_buffer_reset
+circular_buffer_sum_t history_recent_sum(history_const_ptr_t hist, uint8_t len); // Sum of the last len samples
+
+// Defined here to be inlined, it is called for every reading
+static inline void history_push(const history_ptr_t hist, const uint8_t new_data) {
+    const uint8_t bit = !!new_data;
+
+    hist->sum      += bit - (uint8_t)(hist->bits >> (HISTORY_LEN - 1)); // adds new, subtracts the oldest
+    hist->fast_sum += bit - (uint8_t)((hist->bits >> (HISTORY_FAST_LEN - 1)) & 1); // same, in the short window
+    hist->bits = (hist->bits << 1) | bit;
+}
+
+static inline circular_buffer_sum_t history_sum(const history_const_ptr_t hist) {
+    return hist->sum;
+}
+
+static inline circular_buffer_sum_t history_fast_sum(const history_const_ptr_t hist) {
+    return hist->fast_sum;
+}
+
+// Sample ring: the last 'len' multi-bit samples (e.g. charge times), with running sum and sum of
+// squares updated in O(1) on each push, so mean and variance are available at any time
+// Integer only, it never drifts. Windows can be longer than 255 samples
+#define SAMPLE_RING_BITS 8 // Bits of each sample, 8 or 16
+
+#if SAMPLE_RING_BITS == 8
+typedef uint8_t  sample_ring_data_t;
+typedef uint32_t sample_ring_sum_t; // Sums of squares fit up to 65535 samples
+#elif SAMPLE_RING_BITS == 16
+typedef uint16_t sample_ring_data_t;
+typedef uint64_t sample_ring_sum_t; // Sums of squares fit up to 65535 samples
+#else
+#    error SAMPLE_RING_BITS must be 8 or 16
+#endif
+
+struct _sample_ring_t {
+    sample_ring_data_t * data; // pointer to the beginning of the array
+    uint16_t len; // Lenght of the ring
+    uint16_t pos; // current position in the ring
+    uint16_t count; // Samples pushed, up to len
+    sample_ring_sum_t sum; // Sum of all the samples
+    sample_ring_sum_t sum_sq; // Sum of the squares of all the samples
+};
+
+typedef struct _sample_ring_t * sample_ring_ptr_t;
+typedef const struct _sample_ring_t * sample_ring_const_ptr_t;
+typedef struct _sample_ring_t sample_ring_t[1]; // util name
+
+void sample_ring_init(sample_ring_ptr_t ring, sample_ring_data_t * data, uint16_t len); // inits an empty ring
+void sample_ring_reset(sample_ring_ptr_t ring); // Empties the ring
+void sample_ring_push(sample_ring_ptr_t ring, sample_ring_data_t new_data); // pushes new data (popping the old one)
+sample_ring_data_t sample_ring_mean(sample_ring_const_ptr_t ring); // Mean of the samples, rounded down (0 if empty)
+sample_ring_sum_t sample_ring_variance(sample_ring_const_ptr_t ring); // Variance of the samples, rounded down
+
 #endif // CIRCULAR_BUFFER_H defined
@@ -10,6 +10,9 @@
 #define INPUT_PIN_LEFT  10
 #define INPUT_PIN_RIGHT 11
 
+// List of input pins, calls X(pin) once for each input. Used to generate inputs[] and the reading kernels
+#define INPUTS_FOREACH(X) X(INPUT_PIN_UP) X(INPUT_PIN_DOWN) X(INPUT_PIN_LEFT) X(INPUT_PIN_RIGHT)
+
 // Do not change the name of the following variables
 // You should not include this file outside of main.cpp
 
@@ -23,8 +26,17 @@
 #endif
 
 // Array of input pins
-const uint8_t inputs[] PROGMEM = {INPUT_PIN_UP, INPUT_PIN_DOWN, INPUT_PIN_LEFT, INPUT_PIN_RIGHT};
+#define INPUT_ITEM(pin) pin,
+const uint8_t inputs[] PROGMEM = { INPUTS_FOREACH(INPUT_ITEM) };
+#undef INPUT_ITEM
 const uint8_t inputs_len PROGMEM = sizeof(inputs)/sizeof(*inputs); // number of inputs
+#ifdef CAPACITIVE_SENSORS_NUM // The capacitive engine is built for a fixed number of sensors
+_Static_assert(sizeof(inputs)/sizeof(*inputs) == CAPACITIVE_SENSORS_NUM, "CAPACITIVE_SENSORS_NUM must be the number of inputs");
+#endif
+
+// One reading function for each input, with constant port addresses (always stored in flash)
+#include "capacitive_kernels.h"
+CAPACITIVE_KERNELS_TABLE(INPUTS_FOREACH);
 
 // Must delcare functions before using
 void handler_UP_keypress(void);       // All of those functions
@@ -10,4 +10,65 @@ typedef struct {
 
 pin_t id_to_pin(uint8_t id);
 
+// Compile time version of id_to_pin, usable only with constant pin ids (e.g. PIN_PORT_REG(8) is PORTB)
+// Registers are constant I/O addresses, so the compiler can use sbi, cbi, sbic, in and out
+#define PIN_PORT_REG(id) PIN_CONCAT(PORT, PIN_CONCAT(PIN_ID_PORT_, id))
+#define PIN_DDR_REG(id)  PIN_CONCAT(DDR,  PIN_CONCAT(PIN_ID_PORT_, id))
+#define PIN_PIN_REG(id)  PIN_CONCAT(PIN,  PIN_CONCAT(PIN_ID_PORT_, id))
+#define PIN_BITMASK(id)  _BV(PIN_CONCAT(PIN_ID_BIT_, id))
+
+#define PIN_CONCAT(a, b) PIN_CONCAT_(a, b) // Expands the arguments before concatenating them
+#define PIN_CONCAT_(a, b) a ## b
+
+// Calls X(port letter) once for each port with capacitive pins
+#define PIN_PORTS_FOREACH(X) X(B) X(C) X(D) X(F)
+
+// Port indexes (e.g. PIN_PORT_ID_B), PIN_PORTS_NUM is the number of ports
+#define PIN_PORT_ID_ITEM(P) PIN_PORT_ID_ ## P,
+enum { PIN_PORTS_FOREACH(PIN_PORT_ID_ITEM) PIN_PORTS_NUM };
+#undef PIN_PORT_ID_ITEM
+
+// Index of the port of the pin, PIN_PORTS_NUM if the port is not handled
+uint8_t pin_port_id(const pin_t pin);
+
+// Same table of id_to_pin: port letter and bit of each pin id
+#define PIN_ID_PORT_8  B
+#define PIN_ID_BIT_8   4
+#define PIN_ID_PORT_9  B
+#define PIN_ID_BIT_9   5
+#define PIN_ID_PORT_10 B
+#define PIN_ID_BIT_10  6
+#define PIN_ID_PORT_11 B
+#define PIN_ID_BIT_11  7
+#define PIN_ID_PORT_5  C
+#define PIN_ID_BIT_5   6
+#define PIN_ID_PORT_13 C
+#define PIN_ID_BIT_13  7
+#define PIN_ID_PORT_3  D
+#define PIN_ID_BIT_3   0
+#define PIN_ID_PORT_2  D
+#define PIN_ID_BIT_2   1
+#define PIN_ID_PORT_0  D
+#define PIN_ID_BIT_0   2
+#define PIN_ID_PORT_1  D
+#define PIN_ID_BIT_1   3
+#define PIN_ID_PORT_4  D
+#define PIN_ID_BIT_4   4
+#define PIN_ID_PORT_12 D
+#define PIN_ID_BIT_12  6
+#define PIN_ID_PORT_6  D
+#define PIN_ID_BIT_6   7
+#define PIN_ID_PORT_19 F
+#define PIN_ID_BIT_19  0
+#define PIN_ID_PORT_18 F
+#define PIN_ID_BIT_18  1
+#define PIN_ID_PORT_17 F
+#define PIN_ID_BIT_17  4
+#define PIN_ID_PORT_16 F
+#define PIN_ID_BIT_16  5
+#define PIN_ID_PORT_15 F
+#define PIN_ID_BIT_15  6
+#define PIN_ID_PORT_14 F
+#define PIN_ID_BIT_14  7
+
 #endif
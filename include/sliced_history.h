@@ -0,0 +1,50 @@
+#ifndef SLICED_HISTORY_H
+#define SLICED_HISTORY_H
+
+#include <stdint.h> // uint8_t
+
+// Bit-sliced binary histories of 8 sensors (lanes): byte k of the samples holds sample k of all the
+// lanes, one bit each. Window sums are vertical counters: bit i of planes[j] is bit j of the sum of
+// lane i. Pushes, sums and comparisons work on all the lanes with the same byte operations
+#define SLICED_HISTORY_LEN 32 // Samples of each lane, in [1 - 255]
+
+#if   SLICED_HISTORY_LEN < 1
+#    error SLICED_HISTORY_LEN must be in [1 - 255]
+#elif SLICED_HISTORY_LEN < 2
+#    define SLICED_HISTORY_PLANES 1
+#elif SLICED_HISTORY_LEN < 4
+#    define SLICED_HISTORY_PLANES 2
+#elif SLICED_HISTORY_LEN < 8
+#    define SLICED_HISTORY_PLANES 3
+#elif SLICED_HISTORY_LEN < 16
+#    define SLICED_HISTORY_PLANES 4
+#elif SLICED_HISTORY_LEN < 32
+#    define SLICED_HISTORY_PLANES 5
+#elif SLICED_HISTORY_LEN < 64
+#    define SLICED_HISTORY_PLANES 6
+#elif SLICED_HISTORY_LEN < 128
+#    define SLICED_HISTORY_PLANES 7
+#elif SLICED_HISTORY_LEN < 256
+#    define SLICED_HISTORY_PLANES 8 // Enough bits to count up to SLICED_HISTORY_LEN
+#else
+#    error SLICED_HISTORY_LEN must be in [1 - 255]
+#endif
+
+struct _sliced_history_t {
+    uint8_t samples[SLICED_HISTORY_LEN]; // one byte per sample, one bit per lane
+    uint8_t planes[SLICED_HISTORY_PLANES]; // Sums of all the lanes, one plane per bit
+    uint8_t pos; // current position in the samples
+};
+
+typedef struct _sliced_history_t * sliced_history_ptr_t;
+typedef const struct _sliced_history_t * sliced_history_const_ptr_t;
+typedef struct _sliced_history_t sliced_history_t[1]; // util name
+
+void sliced_history_reset(sliced_history_ptr_t hist); // Fills every lane with 50% 1 and 50% zero
+// Pushes one sample in the lanes of mask, the others keep their samples (and their sums)
+void sliced_history_push(sliced_history_ptr_t hist, uint8_t new_data, uint8_t mask);
+// Lanes whose sum is at least value, one bit per lane
+uint8_t sliced_history_at_least(sliced_history_const_ptr_t hist, uint8_t value);
+uint8_t sliced_history_sum(sliced_history_const_ptr_t hist, uint8_t lane); // Sum of a single lane
+
+#endif // SLICED_HISTORY_H defined
@@ -95,11 +95,25 @@
 #define TIMER_INTERRUPT_MODE_OCIC  ((uint8_t)0x88)
 #define TIMER_INTERRUPT_MODE_TOI   ((uint8_t)0x90)
 
+// Input capture settings (only for timers 1, 3)
+// NOTE: Do not change the values, they are studied to be or-ed toghether
+// binary format: 1 0 1 0 0 0 x x
+// first four bits are constant
+// then one bit is for the noise canceler, and last for the edge
+#define TIMER_CAPTURE_FALLING       ((uint8_t)0xA0)
+#define TIMER_CAPTURE_RISING        ((uint8_t)0xA1)
+#define TIMER_CAPTURE_NOISE_CANCEL  ((uint8_t)0xA2) // Captures 4 cycles later, but filters spikes
+
+// Called inside the capture ISR, with the captured counter (i.e. ICRn)
+typedef void (*timer_capture_handler_t)(uint16_t capture);
+
 // A set of useful timer functions
 
 // ===== TIMER SETUP FUNCTIONS ======
 void timer_init(uint8_t timer_id, uint8_t source, uint8_t mode, uint8_t out_mode);
 void timer_init_interrupt(uint8_t timer_id, uint8_t interrupt_mode);
+void timer_init_capture(uint8_t timer_id, uint8_t capture_mode); // edge and noise canceler of ICPn pin
+void timer_capture_handler(uint8_t timer_id, timer_capture_handler_t handler); // NULL to remove it
 
 // ===== TIMER CONTROLS =====
 uint8_t timer_start(uint8_t timer_id); // immediately starts the timer (no computations if timer_id is compile-time constant)
@@ -120,4 +134,8 @@ uint8_t  timer0_compare(uint8_t comp_id, const uint8_t  * new_val);
 uint16_t timer1_compare(uint8_t comp_id, const uint16_t * new_val);
 uint16_t timer3_compare(uint8_t comp_id, const uint16_t * new_val);
 
+// get last captured counter (ICRn register)
+uint16_t timer1_capture(void);
+uint16_t timer3_capture(void);
+
 #endif
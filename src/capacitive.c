@@ -26,6 +26,7 @@
 #include <stdint.h> // uint8_t, uint32_t
 #include <string.h> // memset
 #include <avr/pgmspace.h> // PROGMEM
+#include <util/atomic.h> // Atomic functions (i.e. disabling interrupts)
 
 #include "cpu.h"
 #include "capacitive.h" // capacitive_pin_t definition
@@ -35,210 +36,665 @@
 // Next requires C11
 _Static_assert(RELEASE_CONDITION <= LOW_THRESHOLD, "RELEASE_CONDITION macro must be greater than LOW_THRESHOLD");
 _Static_assert(PRESS_CONDITION >= HIGH_THRESHOLD, "PRESS_CONDITION macro must be less than HIGH_THRESHOLD");
+_Static_assert((LOW_THRESHOLD <= 100) && (HIGH_THRESHOLD <= 100), "Thresholds are percents, must be in [0-100]");
+_Static_assert((PRESS_CONDITION <= 100) && (RELEASE_CONDITION <= 100), "Conditions are percents, must be in [0-100]");
+_Static_assert((THRESHOLD_MAX >= 1) && (THRESHOLD_MAX <= 65534), "THRESHOLD_MAX must be in [1 - 65534]");
+_Static_assert((PRESS_LOCKOUT_US < 1000000000UL) && (RELEASE_HOLD_US < 1000000000UL), "Debounce times must be below 1000s (clock wraps)");
+
+// Sums of a window compared with a percent of SAMPLES_NUM, without floating point
+#define COUNT_CEIL(percent)  ((SAMPLES_NUM*(percent) + 99) / 100) // Smallest sum >= percent
+#define COUNT_FLOOR(percent) ((SAMPLES_NUM*(percent)) / 100) // Greatest sum <= percent
+
+#ifdef CAPACITIVE_SENSORS_NUM // The number of sensors is known at compile time
+#    define SENSORS_NUM(num) CAPACITIVE_SENSORS_NUM // num arguments are ignored, arrays have a fixed size
+#    define UNROLL_SENSORS _Pragma("GCC unroll 32") // Unrolls the next loop over the sensors
+#else
+#    define SENSORS_NUM(num) (num)
+#    define UNROLL_SENSORS
+#endif
 
 #define BUFFER_NONE 0x00
 #define BUFFER_HIGH 0x01
 #define BUFFER_LOW  0x02
 #define BUFFER_BOTH (BUFFER_LOW | BUFFER_HIGH)
-static inline void fill_buffer(const capacitive_sensor_ptr_t sensors, const uint8_t * const wich_buffer, const uint8_t num) {
-    uint8_t i, sensor_id; // counters
-    uint8_t ckres; // result of check_port
 
-    for (i = 0; i < SAMPLES_NUM; i++) { // performs enough readings to fill the buffer
-        for (sensor_id = 0; sensor_id < num; sensor_id++) {
-            if (wich_buffer[sensor_id] & BUFFER_LOW) {
-                set_threshold(sensors[sensor_id].low_threshold); // Low threshold must read as 1
-                ckres = check_port(sensors[sensor_id].pin);
-                if (ckres) circular_buffer_push(sensors[sensor_id].low_buffer, 1);
-                else       circular_buffer_push(sensors[sensor_id].low_buffer, 0);
-            } // end if
-        } // end for
-        _MemoryBarrier(); // Forces keeping the order (jouning the loop is a bad thing, slows down the execution)
-        for (sensor_id = 0; sensor_id < num; sensor_id++) {
-            if (wich_buffer[sensor_id] & BUFFER_HIGH) {
-                set_threshold(sensors[sensor_id].high_threshold); // Low threshold must read as 0
-                ckres = check_port(sensors[sensor_id].pin);
-                if (ckres) circular_buffer_push(sensors[sensor_id].high_buffer, 1);
-                else circular_buffer_push(sensors[sensor_id].high_buffer, 0);
-            } // end if
-        } // end for
+#if defined(USE_SLICED_HISTORY)
+#    include "sliced_history.h"
+_Static_assert(SAMPLES_NUM == SLICED_HISTORY_LEN, "USE_SLICED_HISTORY requires SAMPLES_NUM equal to SLICED_HISTORY_LEN");
+#    define SLICED_GROUPS ((MAX_SENSORS_NUM + 7) / 8) // 8 sensors (lanes) per group
+static sliced_history_t low_slices[SLICED_GROUPS], high_slices[SLICED_GROUPS]; // Histories of all the sensors
+static uint8_t low_round[SLICED_GROUPS], high_round[SLICED_GROUPS]; // Readings of the current round
+#    define low_sum(sensor)  sliced_history_sum(low_slices[(sensor)->index / 8], (sensor)->index % 8)
+#    define high_sum(sensor) sliced_history_sum(high_slices[(sensor)->index / 8], (sensor)->index % 8)
+
+// Pushes the readings of a round in the histories, 8 sensors at a time
+static void push_round(const uint8_t * const wich_buffer, const uint8_t num) {
+    uint8_t sensor_id, group; // counters
+    uint8_t low_mask[SLICED_GROUPS], high_mask[SLICED_GROUPS]; // Sensors that have been read
+
+    memset(low_mask , 0, sizeof(low_mask ));
+    memset(high_mask, 0, sizeof(high_mask));
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
+        if (wich_buffer[sensor_id] & BUFFER_LOW)
+            low_mask[sensor_id / 8] |= _BV(sensor_id % 8);
+        if (wich_buffer[sensor_id] & BUFFER_HIGH)
+            high_mask[sensor_id / 8] |= _BV(sensor_id % 8);
+    }
+    for (group = 0; group < (SENSORS_NUM(num) + 7) / 8; group++) {
+        sliced_history_push(low_slices[group] , low_round[group] , low_mask[group] );
+        sliced_history_push(high_slices[group], high_round[group], high_mask[group]);
+        low_round[group] = high_round[group] = 0; // Ready for the next round
+    }
+}
+#elif defined(USE_HISTORY_BUFFER)
+_Static_assert(SAMPLES_NUM == HISTORY_LEN, "USE_HISTORY_BUFFER requires SAMPLES_NUM equal to HISTORY_LEN");
+#    define buffer_push history_push
+#    define low_sum(sensor)  history_sum((sensor)->low_buffer)
+#    define high_sum(sensor) history_sum((sensor)->high_buffer)
+#    ifdef USE_ADAPTIVE_WINDOW // Sums of the decision windows, scaled to SAMPLES_NUM readings
+_Static_assert((WINDOW_SHIFT_MAX <= 3) && ((SAMPLES_NUM >> WINDOW_SHIFT_MAX) << WINDOW_SHIFT_MAX == SAMPLES_NUM), "WINDOW_SHIFT_MAX must be in [0 - 3]");
+_Static_assert((NOISE_CLEAN <= NOISE_NOISY) && (NOISE_NOISY <= 255), "NOISE_CLEAN and NOISE_NOISY must be in [0 - 255], in order");
+_Static_assert((NOISE_MARGIN >= 0) && (LOW_THRESHOLD >= NOISE_MARGIN) && (HIGH_THRESHOLD + NOISE_MARGIN <= 100), "NOISE_MARGIN moves the thresholds out of [0 - 100]");
+#        define WINDOW_SUM(hist, shift) (history_recent_sum(hist, SAMPLES_NUM >> (shift)) << (shift))
+#        define low_window_sum(sensor)  WINDOW_SUM((sensor)->low_buffer, (sensor)->window_shift)
+#        define high_window_sum(sensor) WINDOW_SUM((sensor)->high_buffer, (sensor)->window_shift)
+#    endif
+#else
+#    define buffer_push circular_buffer_push
+#    define low_sum(sensor)  circular_buffer_sum((sensor)->low_buffer)
+#    define high_sum(sensor) circular_buffer_sum((sensor)->high_buffer)
+#endif
+#ifndef USE_ADAPTIVE_WINDOW // Decisions use the whole window
+#    define low_window_sum  low_sum
+#    define high_window_sum high_sum
+#endif
+
+#ifdef USE_SPRT
+_Static_assert((RELEASE_CONDITION < LOW_THRESHOLD) && (PRESS_CONDITION > HIGH_THRESHOLD), "USE_SPRT needs conditions different from thresholds");
+
+// Log-likelihood ratio of p1 against p0, in SPRT_SCALE units (folded at compile time)
+#define SPRT_LLR(p1, p0) __builtin_lround(SPRT_SCALE*__builtin_log((double)(p1)/(p0)))
+// Press: high readings of a pressed pad read 1 with probability PRESS_CONDITION, HIGH_THRESHOLD otherwise
+static const int16_t sprt_press_hit   = SPRT_LLR(PRESS_CONDITION, HIGH_THRESHOLD); // read 1
+static const int16_t sprt_press_miss  = SPRT_LLR(100 - PRESS_CONDITION, 100 - HIGH_THRESHOLD); // read 0
+// Release: low readings of a released pad read 1 with probability RELEASE_CONDITION, LOW_THRESHOLD otherwise
+static const int16_t sprt_release_hit  = SPRT_LLR(100 - RELEASE_CONDITION, 100 - LOW_THRESHOLD); // read 0
+static const int16_t sprt_release_miss = SPRT_LLR(RELEASE_CONDITION, LOW_THRESHOLD); // read 1
+// Wrong decision probability of a single test. A test lasts at least a reading, so there are at
+// most SPRT_READS_PER_SECOND tests per second
+#define SPRT_ALPHA (SPRT_FALSE_PER_HOUR/3600.0/(SPRT_READS_PER_SECOND))
+// Wald bounds, evidence needed to accept (or reject) the press or the release
+static const int16_t sprt_accept = SPRT_LLR(1.0 - SPRT_BETA, SPRT_ALPHA);
+static const int16_t sprt_reject = SPRT_LLR(SPRT_BETA, 1.0 - SPRT_ALPHA);
+
+// Accepted evidence stays at the bound until the decision restarts the test (see sprt_restart)
+// A rejected test restarts from 0, so a released pad does not keep testing old evidence
+static inline int16_t sprt_update(int16_t llr, const int16_t step) {
+    llr += step;
+    if (llr > sprt_accept) llr = sprt_accept;
+    if (llr <= sprt_reject) llr = 0;
+    return llr;
+}
+
+// Both tests start again, after a press or a release
+static inline void sprt_restart(const capacitive_sensor_ptr_t sensor) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { // The sampler may be updating them
+        sensor->press_llr = sensor->release_llr = 0;
+    }
+}
+#endif // USE_SPRT
+
+// Every reading is pushed from here, by fill_buffer and by the streaming sampler
+static inline void push_low(const capacitive_sensor_ptr_t sensor, const uint8_t read) {
+#ifdef USE_SLICED_HISTORY
+    low_round[sensor->index / 8] |= (!!read) << (sensor->index % 8); // Pushed by push_round
+#else
+    buffer_push(sensor->low_buffer, read);
+#endif
+#ifdef USE_SPRT
+    sensor->release_llr = sprt_update(sensor->release_llr, read ? sprt_release_miss : sprt_release_hit);
+#endif
+}
+
+static inline void push_high(const capacitive_sensor_ptr_t sensor, const uint8_t read) {
+#ifdef USE_SLICED_HISTORY
+    high_round[sensor->index / 8] |= (!!read) << (sensor->index % 8); // Pushed by push_round
+#else
+    buffer_push(sensor->high_buffer, read);
+#endif
+#ifdef USE_SPRT
+    sensor->press_llr = sprt_update(sensor->press_llr, read ? sprt_press_hit : sprt_press_miss);
+#endif
+}
+
+// Each fill_round performs one reading for each sensor, and pushes it in the buffers
+#if defined(USE_CHARGE_TIME)
+#ifdef USE_BASELINE_TRACKING
+_Static_assert(RELEASE_DELTA < PRESS_DELTA, "RELEASE_DELTA must be less than PRESS_DELTA");
+_Static_assert(BASELINE_SHIFT < 24, "BASELINE_SHIFT too big for the baseline precision");
+_Static_assert((BASELINE_EVERY >= 1) && (BASELINE_EVERY <= 255), "BASELINE_EVERY must be in [1 - 255]");
+
+// Exponential moving average of the charge time, baseline += (time - baseline) / 2^BASELINE_SHIFT
+static inline void update_baseline(const capacitive_sensor_ptr_t sensor, const uint8_t time) {
+    int32_t diff = (int32_t)((uint32_t)time << 16) - (int32_t)sensor->baseline;
+    sensor->baseline += diff >> BASELINE_SHIFT; // Arithmetic shift, diff can be negative
+}
+#endif
+
+// Measures the charge time once per sample, the measure is compared with both thresholds
+static inline void fill_round(const capacitive_sensor_ptr_t sensors, const uint8_t * const wich_buffer, const uint8_t num) {
+    uint8_t sensor_id; // counter
+    const capacitive_pin_t * pins[SENSORS_NUM(num)]; // pins to read
+    uint8_t times[SENSORS_NUM(num)]; // result of capacitive_pins_measure
+#ifdef USE_BASELINE_TRACKING
+    static uint8_t baseline_round = 0; // rounds since the last baseline update
+    uint8_t update; // this round updates the baselines
+
+    update = (++baseline_round >= BASELINE_EVERY);
+    if (update) baseline_round = 0;
+#endif
+
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++)
+        pins[sensor_id] = &sensors[sensor_id].io;
+
+    capacitive_pins_measure(pins, times, SENSORS_NUM(num)); // One measure for each sensor
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
+        // Same as check_port: 1 if pin was not charged before the threshold
+        if (wich_buffer[sensor_id] & BUFFER_LOW)
+            push_low(sensors + sensor_id, times[sensor_id] > sensors[sensor_id].low_threshold);
+        if (wich_buffer[sensor_id] & BUFFER_HIGH)
+            push_high(sensors + sensor_id, times[sensor_id] > sensors[sensor_id].high_threshold);
+#ifdef USE_BASELINE_TRACKING
+        if (!sensors[sensor_id].pressed) { // A touched pad is not the baseline
+            if (update && (times[sensor_id] <= sensors[sensor_id].low_threshold)) // nor a hovering foot
+                update_baseline(sensors + sensor_id, times[sensor_id]);
+#    ifdef USE_NOISE_DELTAS
+            sample_ring_push(sensors[sensor_id].noise_ring, times[sensor_id]); // nor its noise
+#    endif
+        }
+#endif
     } // end for
 }
+#elif defined(USE_PORT_PARALLEL_READ)
+// Same as below, but reads all the sensors toghether with check_ports. Low and high reads of
+// a sensor come from the same charge, so each port is charged once per round (unless thresholds
+// are too close, see check_ports): there is no second charge waiting for the discharge of the
+// first one, and the port discharges while the other ports are read
+static inline void check_round(const capacitive_sensor_ptr_t sensors, const uint8_t * const wich_buffer,
+                               uint8_t * const low_read, uint8_t * const high_read, const uint8_t num) {
+    uint8_t sensor_id, i, first, len; // counters
+    uint8_t reads = 0, high_start; // number of reads, first high read
+    uint8_t id[2*SENSORS_NUM(num)]; // sensor of each read (low reads first, then high reads)
+    const capacitive_pin_t * pin[2*SENSORS_NUM(num)]; // pin of each read
+    capacitive_threshold_t thr[2*SENSORS_NUM(num)]; // threshold of each read
+    uint32_t ckres, bit; // result of check_ports, current bit of the result
+
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++)
+        if (wich_buffer[sensor_id] & BUFFER_LOW) {
+            id[reads] = sensor_id;
+            pin[reads] = &sensors[sensor_id].io;
+            thr[reads] = sensors[sensor_id].low_threshold; // Low threshold must read as 1
+            reads++;
+        }
+    high_start = reads;
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++)
+        if (wich_buffer[sensor_id] & BUFFER_HIGH) {
+            id[reads] = sensor_id;
+            pin[reads] = &sensors[sensor_id].io;
+            thr[reads] = sensors[sensor_id].high_threshold; // High threshold must read as 0
+            reads++;
+        }
+
+    for (first = 0; first < reads; first += len) {
+        len = (reads - first <= 32) ? reads - first : high_start; // More than 16 sensors: low and high apart
+        ckres = capacitive_pins_check(pin + first, thr + first, len);
+        for (i = first, bit = 1; i < first + len; i++, bit <<= 1) {
+            if (i < high_start)
+                low_read[id[i]] = !!(ckres & bit);
+            else
+                high_read[id[i]] = !!(ckres & bit);
+        }
+    }
+}
+#else // USE_PORT_PARALLEL_READ not defined
+static inline void check_round(const capacitive_sensor_ptr_t sensors, const uint8_t * const wich_buffer,
+                               uint8_t * const low_read, uint8_t * const high_read, const uint8_t num) {
+    uint8_t sensor_id; // counter
+
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
+        if (wich_buffer[sensor_id] & BUFFER_LOW) {
+            set_threshold(sensors[sensor_id].low_threshold); // Low threshold must read as 1
+            low_read[sensor_id] = !!capacitive_pin_check(&sensors[sensor_id].io);
+        } // end if
+    } // end for
+    _MemoryBarrier(); // Forces keeping the order (jouning the loop is a bad thing, slows down the execution)
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
+        if (wich_buffer[sensor_id] & BUFFER_HIGH) {
+            set_threshold(sensors[sensor_id].high_threshold); // Low threshold must read as 0
+            high_read[sensor_id] = !!capacitive_pin_check(&sensors[sensor_id].io);
+        } // end if
+    } // end for
+}
+#endif // USE_CHARGE_TIME, USE_PORT_PARALLEL_READ
+
+#ifndef USE_CHARGE_TIME
+// Reads the thresholds of the round (see check_round above), then pushes the readings
+static inline void fill_round(const capacitive_sensor_ptr_t sensors, const uint8_t * const wich_buffer, const uint8_t num) {
+    uint8_t sensor_id; // counter
+    uint8_t low_read[SENSORS_NUM(num)], high_read[SENSORS_NUM(num)]; // results of check_round
+
+    check_round(sensors, wich_buffer, low_read, high_read, num);
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
+        if (wich_buffer[sensor_id] & BUFFER_LOW)
+            push_low(sensors + sensor_id, low_read[sensor_id]);
+        if (wich_buffer[sensor_id] & BUFFER_HIGH)
+            push_high(sensors + sensor_id, high_read[sensor_id]);
+    }
+}
+#endif // USE_CHARGE_TIME
+
+// One round of readings, pushed in the buffers
+static inline void sample_round(const capacitive_sensor_ptr_t sensors, const uint8_t * const wich_buffer, const uint8_t num) {
+    fill_round(sensors, wich_buffer, num);
+#ifdef USE_SLICED_HISTORY
+    push_round(wich_buffer, num);
+#endif
+}
+
+static inline void fill_buffer(const capacitive_sensor_ptr_t sensors, const uint8_t * const wich_buffer, const uint8_t num) {
+    uint8_t i; // counter
+
+    for (i = 0; i < SAMPLES_NUM; i++) // performs enough readings to fill the buffer
+        sample_round(sensors, wich_buffer, num);
+}
+
+#if defined(USE_STATE_SAMPLING) && !defined(USE_CHARGE_TIME) // A charge time measure gives both readings
+#    define STATE_SAMPLING
+_Static_assert(STATE_REFRESH_ROUNDS >= 1, "STATE_REFRESH_ROUNDS must be at least 1");
+
+// Buffers to fill in a round: the one deciding the next event of each sensor (high while released,
+// low while pressed), both every STATE_REFRESH_ROUNDS rounds. Tracking sensors walk both windows,
+// so they read both
+static inline void state_plan(const capacitive_sensor_ptr_t sensors, uint8_t * const wich_buffer,
+                              const uint8_t round, const uint8_t num) {
+    uint8_t sensor_id; // counter
+
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
+        if ((round % STATE_REFRESH_ROUNDS) == 0)
+            wich_buffer[sensor_id] = BUFFER_BOTH; // Refresh, for calibration and gray zone
+#ifdef USE_THRESHOLD_TRACKING
+        else if ((sensors[sensor_id].low_step | sensors[sensor_id].high_step) != 0)
+            wich_buffer[sensor_id] = BUFFER_BOTH;
+#endif
+        else
+            wich_buffer[sensor_id] = sensors[sensor_id].pressed ? BUFFER_LOW : BUFFER_HIGH;
+    }
+}
+#endif // USE_STATE_SAMPLING
+
+// Fills the buffers of all the sensors for a tick
+static void fill_sensors(const capacitive_sensor_ptr_t sensors, const uint8_t num) {
+    uint8_t wich_buffer[SENSORS_NUM(num)];
+#ifdef STATE_SAMPLING
+    uint8_t i; // counter
+
+    for (i = 0; i < SAMPLES_NUM; i++) {
+        state_plan(sensors, wich_buffer, i, num); // pressed may change only between ticks, but it is cheap
+        sample_round(sensors, wich_buffer, num);
+    }
+#else
+    memset(wich_buffer, BUFFER_BOTH, sizeof(wich_buffer)); // Relays on the fact wich_buffer is uint8_t
+    fill_buffer(sensors, wich_buffer, num);
+#endif
+}
+
+#ifdef USE_STREAMING_SAMPLER
+#   include <avr/interrupt.h> // ISR macro
+#   include "timer_utils.h" // Timer 1 compare C
+
+static capacitive_sensor_ptr_t stream_sensors = NULL; // Sensors filled by the sampler ISR
+static uint8_t stream_num = 0; // Number of sensors
+static uint16_t stream_step; // Timer 1 counts between two rounds
+static volatile uint8_t stream_paused = 1; // true while buffers must not be touched
+
+// One round of readings every stream_step counts of Timer 1. SAMPLES_NUM rounds in a tick
+// Other interrupts (i.e. USB) can be served while reading
+ISR(TIMER1_COMPC_vect, ISR_NOBLOCK) {
+    static volatile uint8_t running = 0; // do not overlap rounds
+    uint16_t next, top;
+
+    ATOMIC_BLOCK(ATOMIC_FORCEON) { // 16 bits registers, other ISRs use the same TEMP register
+        top = timer1_compare(TIMER_COMP_A, NULL); // Timer 1 restarts from 0 after top
+        next = timer1_compare(TIMER_COMP_C, NULL) + stream_step;
+        if ((next > top) || (next < stream_step)) // wraps as the timer does
+            next -= top + 1;
+        timer1_compare(TIMER_COMP_C, &next); // Next round
+    }
+
+    if (stream_paused || running) return; // main code is using the sensors, or reading is too slow
+    running = 1;
+    {
+        uint8_t wich_buffer[SENSORS_NUM(stream_num)];
+#ifdef STATE_SAMPLING
+        static uint8_t round = 0; // Rounds done, chooses the refresh rounds
+        state_plan(stream_sensors, wich_buffer, round++, stream_num);
+#else
+        memset(wich_buffer, BUFFER_BOTH, sizeof(wich_buffer)); // Relays on the fact wich_buffer is uint8_t
+#endif
+        sample_round(stream_sensors, wich_buffer, stream_num);
+    }
+    running = 0;
+}
+
+// Starts filling the buffers in background. Timer 1 must be already running in CTC mode (top is OCR1A)
+void capacitive_sampler_start(const capacitive_sensor_ptr_t sensors, const uint8_t num) {
+    uint16_t top, first;
+
+    top = timer1_compare(TIMER_COMP_A, NULL);
+    stream_step = ((uint32_t)top + 1) / SAMPLES_NUM;
+    if (stream_step == 0) // Timer too slow for SAMPLES_NUM rounds each tick
+        stream_step = 1;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        stream_sensors = sensors;
+        stream_num = num;
+        first = stream_step / 2; // between two ticks
+        timer1_compare(TIMER_COMP_C, &first);
+        TIFR1 = _BV(OCF1C); // Clears old events (writing 1 clears the flag)
+        TIMSK1 |= _BV(OCIE1C);
+        stream_paused = 0;
+    }
+}
+#endif // USE_STREAMING_SAMPLER
 
 static inline void set_press_release_threshold(const capacitive_sensor_ptr_t sensors, const uint8_t * const to_probe, const uint8_t num) {
     uint8_t sensor_id;
-    uint8_t overflow; // In case of overflow sets min/max
 
     // All of this can be done in parallel
-    for (sensor_id = 0; sensor_id < num; sensor_id++) {
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
         if (to_probe[sensor_id] == 0) continue; // This has do not be touched
-        overflow = sensors[sensor_id].low_threshold;
-        sensors[sensor_id].low_threshold -= RELEASE_THRESHOLD;
-        if (sensors[sensor_id].low_threshold > overflow) // Underflow (below 0)
-            sensors[sensor_id].low_threshold = 0;
-        overflow = sensors[sensor_id].high_threshold;
-        sensors[sensor_id].high_threshold += PRESS_THRESHOLD;
-        if (sensors[sensor_id].high_threshold < overflow) // Overflowed
-            sensors[sensor_id].high_threshold = UCHAR_MAX;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { // 16 bits, the sampler may be reading them
+            if (sensors[sensor_id].low_threshold < RELEASE_THRESHOLD) // Would underflow (below 0)
+                sensors[sensor_id].low_threshold = 0;
+            else
+                sensors[sensor_id].low_threshold -= RELEASE_THRESHOLD;
+            if (sensors[sensor_id].high_threshold > THRESHOLD_MAX - PRESS_THRESHOLD) // Would overflow
+                sensors[sensor_id].high_threshold = THRESHOLD_MAX;
+            else
+                sensors[sensor_id].high_threshold += PRESS_THRESHOLD;
+        }
     }
 }
 
+// Ends a probe: evidence of the old thresholds is cleared, then the buffers of the probed
+// sensors are filled with readings of the new ones
+static void probe_done(const capacitive_sensor_ptr_t sensors, const uint8_t * const to_probe, const uint8_t num) {
+    uint8_t sensor_id;
+    uint8_t buffer_to_fill[SENSORS_NUM(num)];
+
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
+        buffer_to_fill[sensor_id] = BUFFER_NONE;
+        if (to_probe[sensor_id] != 0) { // For each done sets to_probe = 0
+            sensors[sensor_id].to_probe = 0;
+#ifdef USE_SPRT
+            sensors[sensor_id].press_llr = sensors[sensor_id].release_llr = 0; // Evidence of old thresholds
+#endif
+            buffer_to_fill[sensor_id] = BUFFER_BOTH;
+        }
+    }
+    fill_buffer(sensors, buffer_to_fill, num);
+}
+
+#ifdef USE_BASELINE_TRACKING
+#ifdef USE_NOISE_DELTAS
+_Static_assert((NOISE_RING_LEN >= 2) && (NOISE_SIGMAS >= 1), "NOISE_RING_LEN and NOISE_SIGMAS too small");
+
+// Integer square root, rounded down (one result bit at a time)
+static uint16_t isqrt(uint32_t x) {
+    uint32_t root = 0, bit = (uint32_t)1 << 30;
+
+    while (bit > x) bit >>= 2;
+    while (bit != 0) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+#endif
+
+// Derives the thresholds from the baseline: released pads read low, touched pads read high
+static void set_baseline_thresholds(const capacitive_sensor_ptr_t sensor) {
+    uint32_t baseline;
+    uint16_t level, press = PRESS_DELTA, release = RELEASE_DELTA;
+#ifdef USE_NOISE_DELTAS
+    sample_ring_t noise; // copy of the sums, the data are not read
+    uint16_t spread;
+#endif
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { // The sampler may be updating it
+        baseline = sensor->baseline;
+#ifdef USE_NOISE_DELTAS
+        noise[0] = sensor->noise_ring[0];
+#endif
+    }
+#ifdef USE_NOISE_DELTAS
+    spread = NOISE_SIGMAS * isqrt(sample_ring_variance(noise)); // at most 4 * 127
+    if (spread > press) { // Noisy pad, both deltas are widened
+        press = spread;
+        release = (uint32_t)spread * RELEASE_DELTA / PRESS_DELTA;
+    }
+#endif
+    level = (baseline + 0x8000) >> 16; // rounded
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { // 16 bits, the sampler may be reading them
+        sensor->low_threshold  = (level + release > UCHAR_MAX) ? UCHAR_MAX : level + release;
+        sensor->high_threshold = (level + press   > UCHAR_MAX) ? UCHAR_MAX : level + press;
+    }
+}
+
+// Called every tick instead of probing, re-calibration requests are satisfied by the baseline
+static void baseline_thresholds(const capacitive_sensor_ptr_t sensors, const uint8_t num) {
+    uint8_t sensor_id;
+
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
+        sensors[sensor_id].to_probe = 0;
+        set_baseline_thresholds(sensors + sensor_id);
+    }
+}
+#endif // USE_BASELINE_TRACKING
+
+#ifdef USE_CHARGE_TIME
+// Index of the sorted measures to use as threshold (see probe below)
+#define LOW_THRESHOLD_INDEX  (COUNT_CEIL(100 - LOW_THRESHOLD) - 1)
+#define HIGH_THRESHOLD_INDEX (SAMPLES_NUM - COUNT_CEIL(HIGH_THRESHOLD))
+_Static_assert(COUNT_CEIL(100 - LOW_THRESHOLD) >= 1, "LOW_THRESHOLD too high for SAMPLES_NUM samples");
+_Static_assert(COUNT_CEIL(HIGH_THRESHOLD) >= 1, "HIGH_THRESHOLD too low for SAMPLES_NUM samples");
+
+// Probes threshold from charge time measures. Takes SAMPLES_NUM measures per sensor,
+// then chooses the thresholds such that more than LOW_THRESHOLD of the measures
+// are greater than low_threshold, and less than HIGH_THRESHOLD are greater than high_threshold
+// (i.e. the same result adjust_interval reaches sweeping the thresholds)
+static void probe(const capacitive_sensor_ptr_t sensors, const uint8_t * const to_probe, const uint8_t num) {
+    uint8_t sensor_id, i, j; // counters
+    const capacitive_pin_t * pins[SENSORS_NUM(num)]; // pins to measure
+    uint8_t times[SENSORS_NUM(num)]; // result of capacitive_pins_measure
+    uint8_t samples[SENSORS_NUM(num)][SAMPLES_NUM]; // All the measures, sorted
+    uint8_t swap; // temporany
+
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++)
+        pins[sensor_id] = &sensors[sensor_id].io;
+
+    for (i = 0; i < SAMPLES_NUM; i++) {
+        capacitive_pins_measure(pins, times, SENSORS_NUM(num)); // measures all the sensors, it costs as measuring one
+        for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) { // Insertion sort, one item at a time
+            for (j = i; (j > 0) && (samples[sensor_id][j - 1] > times[sensor_id]); j--)
+                samples[sensor_id][j] = samples[sensor_id][j - 1];
+            samples[sensor_id][j] = times[sensor_id];
+        }
+    }
+
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
+        if (to_probe[sensor_id] == 0) continue; // This has not to be done
+        swap = samples[sensor_id][LOW_THRESHOLD_INDEX];
+        sensors[sensor_id].low_threshold = (swap > 0) ? swap - 1 : 0; // samples above are strictly greater
+        sensors[sensor_id].high_threshold = samples[sensor_id][HIGH_THRESHOLD_INDEX];
+#ifdef USE_BASELINE_TRACKING
+        sensors[sensor_id].baseline = (uint32_t)samples[sensor_id][SAMPLES_NUM/2] << 16; // median
+#endif
+    }
+    set_press_release_threshold(sensors, to_probe, num); // Now sets some sensibility
+#ifdef USE_BASELINE_TRACKING
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++)
+        if (to_probe[sensor_id] != 0)
+            set_baseline_thresholds(sensors + sensor_id); // Overrides the probed ones
+#endif
+
+    probe_done(sensors, to_probe, num);
+}
+#else // USE_CHARGE_TIME not defined
+
 // +--- NB ---------------------------------------------+
 // |   increasing threeshold leads to more 0 readings   |
 // |   decreasing threeshold leads to more 1 readings   |
 // +----------------------------------------------------+
 
-// Sets the best threeshold
-static void adjust_interval(const capacitive_sensor_ptr_t sensors, const uint8_t * const to_probe, const uint8_t num) {
-    uint8_t sensor_id, at_least_one_ck; // counter through sensors array
-    uint8_t high_done[num], low_done[num]; // counters
-    uint8_t high_dir[num], low_dir[num]; // true if need to increase the threshold
-    uint8_t buffer_to_fill[num];
-
-    // Preliminary fills all the buffers
-    memset(buffer_to_fill, BUFFER_BOTH, sizeof(buffer_to_fill)); // Relays on the fact buffer_to_fill is uint8_t
-    memset(high_done, 0, sizeof(high_done));
-    memset(low_done , 0, sizeof(low_done )); // Resets done buffers
-    // Noe excludes what hasn't to be done
-    for (sensor_id = 0; sensor_id < num; sensor_id++)
-        if (to_probe[sensor_id] == 0) { // Not to do
-            buffer_to_fill[sensor_id] = BUFFER_NONE; // Do not fill noone of the buffers
-            high_done[sensor_id] = low_done[sensor_id] = 1; // All done!
-        }
+// Sweep of a threshold, from the probed point toward the final value
+#define SWEEP_FIRST      0 // First test, chooses the direction
+#define SWEEP_TO_VALID   1 // Value is not valid yet, the first valid one is the final
+#define SWEEP_TO_INVALID 2 // Value is valid, the last valid one is the final
+#define SWEEP_DONE       3
+#define SWEEP_UNKNOWN    2 // sweep_test needs more readings
 
-    fill_buffer(sensors, buffer_to_fill, num); // Parallel buffer filling
+// 1 if at least 'least' of SAMPLES_NUM readings are 1s, 0 if they cannot be anymore, else SWEEP_UNKNOWN
+static inline uint8_t sweep_test(const uint8_t ones, const uint8_t reads, const uint8_t least) {
+    if (ones >= least) return 1;
+    if (ones + (SAMPLES_NUM - reads) < least) return 0; // Even if all the remaining are 1s
+    return SWEEP_UNKNOWN;
+}
 
-    for (sensor_id = 0; sensor_id < num; sensor_id++) { // Two operations in the loop can be executed sequentially
-        if (  (!low_done[sensor_id]) &&
-           (circular_buffer_sum(sensors[sensor_id].low_buffer) <= SAMPLES_NUM*LOW_THRESHOLD)   ) // must sum high
-             low_dir[sensor_id] = 0; // Should decrease threshold to get an higher sum (more 1s)
-        else low_dir[sensor_id] = 1; // Should increase threshold
+// Moves a threshold after the test of its value. valid_up is true if valid values are above the final
+// one (high threshold), false if they are below (low threshold). Returns the new state
+static uint8_t sweep_move(capacitive_threshold_t * const threshold, uint8_t state, const uint8_t valid, const uint8_t valid_up) {
+    uint8_t up; // direction of the next step
 
-        if (   (!high_done[sensor_id]) &&
-           (circular_buffer_sum(sensors[sensor_id].high_buffer) >= SAMPLES_NUM*HIGH_THRESHOLD)   ) // must sum low
-             high_dir[sensor_id] = 1; // Should increase threshold to get a lower sum (more 0s)
-        else high_dir[sensor_id] = 0; // Should decrease threshold
+    if (state == SWEEP_FIRST) {
+        state = valid ? SWEEP_TO_INVALID : SWEEP_TO_VALID;
+    } else if (state == SWEEP_TO_VALID) {
+        if (valid) return SWEEP_DONE; // First valid one
+    } else if (!valid) { // SWEEP_TO_INVALID
+        *threshold += valid_up ? 1 : -1; // The previous one was the last valid
+        return SWEEP_DONE;
     }
 
-    // Now phisically move the thresholds according to preliminary readings
+    up = (state == SWEEP_TO_VALID) ? valid_up : !valid_up;
+    if (*threshold == (up ? THRESHOLD_MAX : 0)) // Cannot move anymore, keeps the limit
+        return SWEEP_DONE;
+    *threshold += up ? 1 : -1;
+    return state;
+}
+
+// Sets the best threeshold. Each threshold is swept once, from the probed point to its final value:
+// low_threshold is the highest value reading more than LOW_THRESHOLD 1s, high_threshold is the lowest
+// reading less than HIGH_THRESHOLD 1s. The 1s of the current value are counted, and the sweep
+// moves on as soon as the result is known, so mostly the final values need all the SAMPLES_NUM readings
+static void adjust_interval(const capacitive_sensor_ptr_t sensors, const uint8_t * const to_probe, const uint8_t num) {
+    uint8_t sensor_id, test; // counter, result of sweep_test
+    uint8_t low_state[SENSORS_NUM(num)], high_state[SENSORS_NUM(num)]; // SWEEP_ states
+    uint8_t low_ones[SENSORS_NUM(num)], high_ones[SENSORS_NUM(num)]; // 1s read with the current values
+    uint8_t low_reads[SENSORS_NUM(num)], high_reads[SENSORS_NUM(num)]; // readings of the current values
+    uint8_t low_read[SENSORS_NUM(num)], high_read[SENSORS_NUM(num)]; // results of check_round
+    uint8_t buffer_to_fill[SENSORS_NUM(num)]; // thresholds to read in the round
+    uint8_t to_read; // not zero if at least one threshold is still sweeping
+
+    memset(low_ones, 0, sizeof(low_ones));
+    memset(high_ones, 0, sizeof(high_ones));
+    memset(low_reads, 0, sizeof(low_reads));
+    memset(high_reads, 0, sizeof(high_reads));
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++)
+        low_state[sensor_id] = high_state[sensor_id] = to_probe[sensor_id] ? SWEEP_FIRST : SWEEP_DONE;
+
     while ( 1 ) { // repeats always until a break
-        at_least_one_ck = 0;
-        for (sensor_id = 0; sensor_id < num; sensor_id++) { // Everything in the loop is sequentializable
-            if (!low_done[sensor_id]) {
-                // if probing thresholds increase
-                if (low_dir[sensor_id] == 1) { // Needs to increment, but first checks for maximum
-                    if (sensors[sensor_id].low_threshold == UCHAR_MAX) {
-                        low_done[sensor_id] = 1; // All done for this time
-                        at_least_one_ck = UCHAR_MAX; // Forces re-execution of the while (see below)
-                        break; // Repeats again the process
-                    }
-                    sensors[sensor_id].low_threshold++;
-                }
-                if (low_dir[sensor_id] == 0) { // Needs to decrement, but first checks for minimum
-                    if (sensors[sensor_id].low_threshold == 0) { // "UCHAR_MIN"
-                        low_done[sensor_id] = 1; // All done for this time
-                        at_least_one_ck = UCHAR_MAX; // Forces re-execution of the while (see below)
-                        break; // Repeats again the process
-                    }
-                    sensors[sensor_id].low_threshold--;
-                }
-                at_least_one_ck = 1; // This sensor has not done
-            } else { // Removes filling low buffer
-                buffer_to_fill[sensor_id] &= ~BUFFER_LOW; // Stops watching this buffer
-            }
-            if (!high_done[sensor_id]) {
-                // if probing thresholds decrease
-                if (high_dir[sensor_id] == 1) {
-                    if (sensors[sensor_id].high_threshold == UCHAR_MAX) {
-                        high_done[sensor_id] = 1; // All done for this time
-                        at_least_one_ck = UCHAR_MAX; // Forces re-execution of the while (see below)
-                        break; // Repeats again the process
-                    }
-                    sensors[sensor_id].high_threshold++;
-                }
-                if (high_dir[sensor_id] == 0) {
-                    if (sensors[sensor_id].high_threshold == 0) { // "UCHAR_MIN"
-                        high_done[sensor_id] = 1; // All done for this time
-                        at_least_one_ck = UCHAR_MAX; // Forces re-execution of the while (see below)
-                        break; // Repeats again the process
-                    }
-                    sensors[sensor_id].high_threshold--;
-                }
-                at_least_one_ck = 1;
-            } else { // Removes filling high buffer
-                buffer_to_fill[sensor_id] &= ~BUFFER_HIGH; // Stops watching this buffer
-            }
-        } // end for
-        if (at_least_one_ck == 0) break; // everything done!
-        if (at_least_one_ck == UCHAR_MAX) continue; // restarts loop
+        to_read = 0;
+        for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
+            buffer_to_fill[sensor_id] = BUFFER_NONE;
+            if (low_state[sensor_id]  != SWEEP_DONE) buffer_to_fill[sensor_id] |= BUFFER_LOW;
+            if (high_state[sensor_id] != SWEEP_DONE) buffer_to_fill[sensor_id] |= BUFFER_HIGH;
+            to_read |= buffer_to_fill[sensor_id];
+        }
+        if (to_read == 0) break; // everything done!
 
-        // Now collect some samples from the sensor
-        fill_buffer(sensors, buffer_to_fill, num); // Parallel buffer filling
-                                                // sequentialize buffer fillin may result in a significant slowdown
+        check_round(sensors, buffer_to_fill, low_read, high_read, num); // Parallel reading, buffers are not touched
 
-        _MemoryBarrier();
-        for (sensor_id = 0; sensor_id < num; sensor_id++) { // Now again, everything in the loop is sequentializable
-            if (!low_done[sensor_id]) {
-                if (low_dir[sensor_id] == 1) { // increasing low threshold
-                    if (circular_buffer_sum(sensors[sensor_id].low_buffer) <= SAMPLES_NUM*LOW_THRESHOLD) { // must sum high
-                        sensors[sensor_id].low_threshold--; // low threshold was too high, last stored was good
-                        low_done[sensor_id] = 1; // do not probe low anymore
-                    }
-                } else if (low_dir[sensor_id] == 0) { // decreasing low threshold
-                    if (circular_buffer_sum(sensors[sensor_id].low_buffer) > SAMPLES_NUM*LOW_THRESHOLD) // must sum high
-                        low_done[sensor_id] = 1; // satisfied, do not probe low anymore
+        for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) { // Everything in the loop is sequentializable
+            if (buffer_to_fill[sensor_id] & BUFFER_LOW) {
+                low_ones[sensor_id] += low_read[sensor_id];
+                low_reads[sensor_id]++;
+                test = sweep_test(low_ones[sensor_id], low_reads[sensor_id], COUNT_FLOOR(LOW_THRESHOLD) + 1); // must sum high
+                if (test != SWEEP_UNKNOWN) { // Known, next value
+                    low_state[sensor_id] = sweep_move(&sensors[sensor_id].low_threshold, low_state[sensor_id], test, 0);
+                    low_ones[sensor_id] = low_reads[sensor_id] = 0;
                 }
-            } // end if low_done
-            if (!high_done[sensor_id]) {
-                if (high_dir[sensor_id] == 0) { // decreasing low threshold
-                    if (circular_buffer_sum(sensors[sensor_id].high_buffer) >= SAMPLES_NUM*HIGH_THRESHOLD) { // must sum low
-                        sensors[sensor_id].high_threshold++; // high threshold was too low
-                        high_done[sensor_id] = 1; // do not probe high anymore
-                    }
-                } else if (high_dir[sensor_id] == 1) { // increasing low threshold
-                    if (circular_buffer_sum(sensors[sensor_id].high_buffer) < SAMPLES_NUM*HIGH_THRESHOLD) // must sum low
-                        high_done[sensor_id] = 1; // do not probe high anymore
+            }
+            if (buffer_to_fill[sensor_id] & BUFFER_HIGH) {
+                high_ones[sensor_id] += high_read[sensor_id];
+                high_reads[sensor_id]++;
+                test = sweep_test(high_ones[sensor_id], high_reads[sensor_id], COUNT_CEIL(HIGH_THRESHOLD)); // must sum low
+                if (test != SWEEP_UNKNOWN) { // Known, next value
+                    high_state[sensor_id] = sweep_move(&sensors[sensor_id].high_threshold, high_state[sensor_id], !test, 1);
+                    high_ones[sensor_id] = high_reads[sensor_id] = 0;
                 }
-            } // end if high_done
+            }
         } // end for
-        _MemoryBarrier();
     } // end while
-    return;
 } // end function
 
 static void probe(const capacitive_sensor_ptr_t sensors, const uint8_t * const to_probe, const uint8_t num) { // Probes threshold
     uint8_t sensor_id; // counter through sensors array
-    uint8_t lowest_high[num], highest_low[num]; // highest and lowest reached by each threshold
-    uint8_t done[num], all_done;
+    capacitive_threshold_t lowest_high[SENSORS_NUM(num)], highest_low[SENSORS_NUM(num)]; // highest and lowest reached by each threshold
+    uint8_t done[SENSORS_NUM(num)], all_done;
     uint32_t times; // iterator counter
-    uint8_t ckres, swap; // result of check_port, temporany
+    uint8_t ckres; // result of check_port
+    capacitive_threshold_t swap, step; // temporany
 
     memset(done, 0, sizeof(done)); // No data has already been processed
     // Subtracts immediately what does not need to be probed
-    for (sensor_id = 0; sensor_id < num; sensor_id++) {
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
         if (to_probe[sensor_id] == 0) // This has not to be done
             done[sensor_id] = 1; // Exclude him
     }
 
     // Sets a General starting point, you can change it if you think performance will benefit
     // However this settings should not change the final output
-    for (sensor_id = 0; sensor_id < num; sensor_id++) {
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
         if (done[sensor_id] == 1) continue; // skips already done
-        lowest_high[sensor_id] = UCHAR_MAX; // Maximum
+        lowest_high[sensor_id] = THRESHOLD_MAX; // Maximum
         highest_low[sensor_id] = 0; // Minum
-        sensors[sensor_id].high_threshold = UCHAR_MAX*3/4;
-        sensors[sensor_id].low_threshold = UCHAR_MAX*1/4;
+        sensors[sensor_id].high_threshold = THRESHOLD_MAX*3UL/4;
+        sensors[sensor_id].low_threshold = THRESHOLD_MAX*1UL/4;
     }
 
     // The first part of the algorithm is intented to give only an approximation onf the final result
     times = 0; // no times in the loop
     while (times < MAX_PROBE_STEPS) { // Checks only the times condition, there is a second
         // Now sets done, a pin is done when (high_threshold > (low_threshold + 1)) is false
-        for (sensor_id = 0; sensor_id < num; sensor_id++)
+        for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++)
             if (sensors[sensor_id].high_threshold <= (sensors[sensor_id].low_threshold + 1))
                 done[sensor_id] = 1; // This pin has done
         all_done = 1; // And now checks if all done
-        for (sensor_id = 0; sensor_id < num; sensor_id++) // Now checks condition to exit cycle: all done
+        for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) // Now checks condition to exit cycle: all done
             if (done[sensor_id] == 0) { // At least one not done
                 all_done = 0;
                 break;
@@ -246,35 +702,38 @@ static void probe(const capacitive_sensor_ptr_t sensors, const uint8_t * const t
         if (all_done) break; // Nothing else to do here!
         times++; // Cycle repeated one more time
         _MemoryBarrier();
-        for (sensor_id = 0; sensor_id < num; sensor_id++) { // For each sensor
+        for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) { // For each sensor
             if (done[sensor_id] == 1) continue; // skips already done
             set_threshold(sensors[sensor_id].low_threshold); // Low threshold must read as 1
-            ckres = check_port(sensors[sensor_id].pin);
+            ckres = capacitive_pin_check(&sensors[sensor_id].io);
             if (ckres) { // Read correct value, tries increasing
                 highest_low[sensor_id] = sensors[sensor_id].low_threshold;
                 sensors[sensor_id].low_threshold += // Takes middle point between low and high
                   /* += */  (sensors[sensor_id].high_threshold - sensors[sensor_id].low_threshold) / 2;
             } else { // Read wrong value, tries decreasing
-                sensors[sensor_id].low_threshold =
-                 /* = */    (sensors[sensor_id].low_threshold + highest_low[sensor_id]) / 2; // average, rounded down
+                sensors[sensor_id].low_threshold = // 32 bits sum, int is 16 bits
+                 /* = */    ((uint32_t)sensors[sensor_id].low_threshold + highest_low[sensor_id]) / 2; // average, rounded down
             } // end if
         } // end for
         _MemoryBarrier();
-        for (sensor_id = 0; sensor_id < num; sensor_id++) { // Again, for each sensor
+        for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) { // Again, for each sensor
             if (done[sensor_id] == 1) continue; // skips already done
             set_threshold(sensors[sensor_id].high_threshold); // High threshold must read as 0
-            ckres = check_port(sensors[sensor_id].pin);
+            ckres = capacitive_pin_check(&sensors[sensor_id].io);
             if (ckres) { // Read wrong value, tries decreasing
                 sensors[sensor_id].high_threshold =
-                  /* = */   (sensors[sensor_id].high_threshold + lowest_high[sensor_id] + 1) / 2; // average, rounded up
+                  /* = */   ((uint32_t)sensors[sensor_id].high_threshold + lowest_high[sensor_id] + 1) / 2; // average, rounded up
             } else { // Read correct value, tries increasing
                 lowest_high[sensor_id] = sensors[sensor_id].high_threshold;
-                sensors[sensor_id].high_threshold +=
-                  /* += */  (sensors[sensor_id].high_threshold - sensors[sensor_id].low_threshold) / 2;
+                step = (sensors[sensor_id].high_threshold - sensors[sensor_id].low_threshold) / 2;
+                if (sensors[sensor_id].high_threshold > THRESHOLD_MAX - step) // Stays in the range
+                    sensors[sensor_id].high_threshold = THRESHOLD_MAX;
+                else
+                    sensors[sensor_id].high_threshold += step;
             } // end if
         } // end for
         _MemoryBarrier();
-        for (sensor_id = 0; sensor_id < num; sensor_id++) { // And again, for each sensor
+        for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) { // And again, for each sensor
             if (done[sensor_id] == 1) continue; // skips already done
             if (sensors[sensor_id].high_threshold <= sensors[sensor_id].low_threshold) { // Should not happen
                 swap = (sensors[sensor_id].low_threshold - sensors[sensor_id].high_threshold + 1) / 2; // high, roundup
@@ -289,85 +748,311 @@ static void probe(const capacitive_sensor_ptr_t sensors, const uint8_t * const t
     adjust_interval(sensors, to_probe, num); // Now fine adjusting
     set_press_release_threshold(sensors, to_probe, num); // Now sets some sensibility
 
-    // For each done sets to_probe = 0
-    for (sensor_id = 0; sensor_id < num; sensor_id++) {
-        if (to_probe[sensor_id] != 0) // This has not to be done
-            sensors[sensor_id].to_probe = 0;
+    probe_done(sensors, to_probe, num);
+}
+#endif // USE_CHARGE_TIME
+
+#if defined(USE_THRESHOLD_TRACKING) && !defined(USE_BASELINE_TRACKING)
+_Static_assert((TRACKING_STEP >= 1) && (TRACKING_STEP <= 15), "TRACKING_STEP must be in [1-15]");
+
+// One step of the walk of a threshold toward the same point probe reaches (see adjust_interval)
+// want_up is true if readings of this tick ask to increase the threshold, valid_up is the side
+// of the point where the final threshold must stay. When the walk crosses the point the step
+// is halved, step 1 crossing ends it (step becomes 0)
+static capacitive_threshold_t track_threshold(capacitive_threshold_t threshold, const uint8_t want_up, const uint8_t valid_up,
+                                              uint8_t * const step, uint8_t * const up) {
+    if (want_up != *up) { // Overshoot
+        if (*step == 1) { // Done, last threshold on the valid side
+            *step = 0;
+            if (want_up != valid_up) {
+                if (valid_up) threshold--; // previous one was good
+                else          threshold++;
+            }
+            return threshold;
+        }
+        *step /= 2; // Goes back slower
+        *up = want_up;
     }
+
+    if (want_up) {
+        if (threshold == THRESHOLD_MAX) *step = 0; // Cannot move more, done
+        threshold = (threshold > THRESHOLD_MAX - *step) ? THRESHOLD_MAX : threshold + *step;
+    } else {
+        if (threshold == 0) *step = 0; // "UCHAR_MIN", done
+        threshold = (threshold < *step) ? 0 : threshold - *step;
+    }
+    return threshold;
 }
 
+// Background re-calibration: sensors with to_probe set start tracking, then every tick their
+// thresholds move at most TRACKING_STEP, reading only the buffers already filled for this tick
+static void track_thresholds(const capacitive_sensor_ptr_t sensors, const uint8_t num) {
+    uint8_t sensor_id; // counter
+    uint8_t low_up, high_up; // directions asked by the buffers
+    uint8_t step, up; // temporany, bitfields have no address
+    capacitive_threshold_t threshold; // next threshold, written at once
+    uint8_t done[SENSORS_NUM(num)]; // sensors that have just finished tracking
+
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
+        capacitive_sensor_ptr_t sensor = sensors + sensor_id;
+
+        done[sensor_id] = 0;
+        // Same conditions of adjust_interval: low must sum high, high must sum low
+        low_up  = low_sum(sensor)  >  COUNT_FLOOR(LOW_THRESHOLD);
+        high_up = high_sum(sensor) >= COUNT_CEIL(HIGH_THRESHOLD);
+
+        if (sensor->to_probe) { // (re)starts tracking from the current thresholds
+#ifdef STATE_SAMPLING
+            if ((sensor->low_step | sensor->high_step) == 0) { // Windows hold mostly one threshold
+                sensor->low_step = sensor->high_step = TRACKING_STEP; // Both are read for a tick (see state_plan)
+                continue; // then tracking starts, to_probe is still set
+            }
+#endif
+            sensor->to_probe = 0;
+            sensor->gray_zone = 0; // no more in grayzone
+            sensor->low_step = sensor->high_step = TRACKING_STEP;
+            sensor->low_up = low_up;
+            sensor->high_up = high_up;
+        }
+
+        if (sensor->low_step != 0) {
+            step = sensor->low_step; up = sensor->low_up;
+            threshold = track_threshold(sensor->low_threshold, low_up, 1, &step, &up);
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) sensor->low_threshold = threshold; // 16 bits, the sampler may be reading it
+            sensor->low_step = step; sensor->low_up = up;
+            done[sensor_id] |= BUFFER_LOW * (step == 0);
+        }
+        if (sensor->high_step != 0) {
+            step = sensor->high_step; up = sensor->high_up;
+            threshold = track_threshold(sensor->high_threshold, high_up, 0, &step, &up);
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) sensor->high_threshold = threshold;
+            sensor->high_step = step; sensor->high_up = up;
+            done[sensor_id] |= BUFFER_HIGH * (step == 0);
+        }
+        if ((done[sensor_id] != 0) && ((sensor->low_step | sensor->high_step) != 0))
+            done[sensor_id] = 0; // Sensibility is set when both have finished
+    }
+    set_press_release_threshold(sensors, done, num); // Now sets some sensibility
+}
+#endif // USE_THRESHOLD_TRACKING
+
+// Decision conditions of a sensor, set by sensor_conditions
+#define COND_RELEASE   0x01 // low readings say released
+#define COND_LOW_GRAY  0x02 // low readings are less than calibrated (LOW_THRESHOLD)
+#define COND_PRESS     0x04 // high readings say pressed
+#define COND_HIGH_GRAY 0x08 // high readings are more than calibrated (HIGH_THRESHOLD)
+
+// Conditions given by the sum of each window (see the percents in capacitive_settings.h)
+// Ranges overlap, the nested one is written last and overrides the other
+static const uint8_t low_conditions[SAMPLES_NUM + 1] PROGMEM = {
+    [0 ... COUNT_FLOOR(LOW_THRESHOLD)]     = COND_LOW_GRAY,
+    [0 ... COUNT_FLOOR(RELEASE_CONDITION)] = COND_LOW_GRAY | COND_RELEASE,
+};
+static const uint8_t high_conditions[SAMPLES_NUM + 1] PROGMEM = {
+    [COUNT_CEIL(HIGH_THRESHOLD) ... SAMPLES_NUM]  = COND_HIGH_GRAY,
+    [COUNT_CEIL(PRESS_CONDITION) ... SAMPLES_NUM] = COND_HIGH_GRAY | COND_PRESS,
+};
+
+// What the decision does for each combination of conditions. Release is handled before press
+#define ACTION_RELEASE   0x01 // Release branch (RELEASE_HOLD_US)
+#define ACTION_PRESS     0x02 // Press branch (PRESS_LOCKOUT_US)
+#define ACTION_LOW_GRAY  0x04 // Low gray zone, checks MAX_TIME_IN_GRAYZONE
+#define ACTION_HIGH_GRAY 0x08 // High gray zone, checks MAX_TIME_IN_GRAYZONE
+#define ACTION_GRAY_KEEP 0x10 // gray_zone is increased, else it restarts from 0
+#define ACTION_GRAY_ADD(action) ((action) >> 5) // Added to gray_zone (one for each gray zone)
+#define LOW_GRAY_ONLY(cond)  (((cond) & (COND_RELEASE | COND_LOW_GRAY)) == COND_LOW_GRAY)
+#define HIGH_GRAY_ONLY(cond) (((cond) & (COND_PRESS | COND_HIGH_GRAY)) == COND_HIGH_GRAY)
+// The high window resets what the low window has counted, unless it is in gray zone too
+#define DECISION(cond) (                                                                         \
+    (((cond) & COND_RELEASE) ? ACTION_RELEASE : 0) | (((cond) & COND_PRESS) ? ACTION_PRESS : 0) | \
+    (LOW_GRAY_ONLY(cond) ? ACTION_LOW_GRAY : 0) | (HIGH_GRAY_ONLY(cond) ? ACTION_HIGH_GRAY : 0) | \
+    (!HIGH_GRAY_ONLY(cond) ? 0 : LOW_GRAY_ONLY(cond) ? (ACTION_GRAY_KEEP | (2 << 5)) : (1 << 5)) )
+static const uint8_t decisions[16] PROGMEM = {
+    DECISION(0x00), DECISION(0x01), DECISION(0x02), DECISION(0x03), DECISION(0x04), DECISION(0x05),
+    DECISION(0x06), DECISION(0x07), DECISION(0x08), DECISION(0x09), DECISION(0x0A), DECISION(0x0B),
+    DECISION(0x0C), DECISION(0x0D), DECISION(0x0E), DECISION(0x0F),
+};
+
+// Compares the buffers of all the sensors, the sampler may be updating the evidence
+static void sensor_conditions(const capacitive_sensor_ptr_t sensors, uint8_t * const cond, const uint8_t num) {
+    uint8_t sensor_id; // counter through sensors array
+#ifdef USE_SLICED_HISTORY
+    uint8_t group, lane; // counters
+    uint8_t release, low_gray, press, high_gray; // one bit per sensor of the group
+
+    for (group = 0; group < (SENSORS_NUM(num) + 7) / 8; group++) { // Each comparison is done for 8 sensors at once
+        release   = ~sliced_history_at_least(low_slices[group], COUNT_FLOOR(RELEASE_CONDITION) + 1);
+        low_gray  = ~sliced_history_at_least(low_slices[group], COUNT_FLOOR(LOW_THRESHOLD) + 1);
+        press     =  sliced_history_at_least(high_slices[group], COUNT_CEIL(PRESS_CONDITION));
+        high_gray =  sliced_history_at_least(high_slices[group], COUNT_CEIL(HIGH_THRESHOLD));
+        for (lane = 0, sensor_id = group * 8; (lane < 8) && (sensor_id < SENSORS_NUM(num)); lane++, sensor_id++)
+            cond[sensor_id] = (((release   >> lane) & 1) ? COND_RELEASE   : 0) |
+                              (((low_gray  >> lane) & 1) ? COND_LOW_GRAY  : 0) |
+                              (((press     >> lane) & 1) ? COND_PRESS     : 0) |
+                              (((high_gray >> lane) & 1) ? COND_HIGH_GRAY : 0);
+    }
+#else // USE_SLICED_HISTORY not defined
+    circular_buffer_sum_t low, high; // sums of the buffers
+#    ifdef USE_HISTORY_BUFFER
+    uint32_t fast = 0; // Sensors pressed by the short window, bit i for sensor i
+#    endif
+
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
+        low  = low_window_sum(sensors + sensor_id);
+        high = high_window_sum(sensors + sensor_id);
+        cond[sensor_id] = pgm_read_byte_near(low_conditions + low) | pgm_read_byte_near(high_conditions + high);
+#    ifdef USE_HISTORY_BUFFER
+        if ((history_fast_sum(sensors[sensor_id].high_buffer) == HISTORY_FAST_LEN) && // Clean hit, does not wait the whole window
+            (2*high >= COUNT_CEIL(PRESS_CONDITION))) {
+            cond[sensor_id] |= COND_PRESS;
+            fast |= (uint32_t)1 << sensor_id;
+        }
+#    endif
+    }
+#endif // USE_SLICED_HISTORY
+
+#ifdef USE_SPRT
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) { // Sequential test decides instead of the windows
+        int16_t release_llr, press_llr;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            release_llr = sensors[sensor_id].release_llr;
+            press_llr = sensors[sensor_id].press_llr;
+        }
+        cond[sensor_id] &= ~(COND_RELEASE | COND_PRESS);
+#    if defined(USE_HISTORY_BUFFER) && !defined(USE_SLICED_HISTORY)
+        if (fast & ((uint32_t)1 << sensor_id)) cond[sensor_id] |= COND_PRESS; // Short window still presses
+#    endif
+        if (release_llr >= sprt_accept) cond[sensor_id] |= COND_RELEASE;
+        if (press_llr   >= sprt_accept) cond[sensor_id] |= COND_PRESS;
+    }
+#endif
+}
+
+#ifdef USE_ADAPTIVE_WINDOW
+// Averages the noisy ticks, then moves the decision window one step toward the noise
+// A pressed pad is far from the calibrated thresholds, its noise is kept
+static inline void adapt_window(const capacitive_sensor_ptr_t sensor) {
+    uint8_t noisy;
+
+    if (sensor->pressed) return;
+    noisy = (low_window_sum(sensor) <= COUNT_FLOOR(LOW_THRESHOLD - NOISE_MARGIN)) ||
+            (high_window_sum(sensor) >= COUNT_CEIL(HIGH_THRESHOLD + NOISE_MARGIN));
+    sensor->noise += ((noisy ? 255 : 0) - sensor->noise) >> NOISE_SHIFT; // Arithmetic shift, can be negative
+    if ((sensor->noise < NOISE_CLEAN) && (sensor->window_shift < WINDOW_SHIFT_MAX))
+        sensor->window_shift++; // Clean, halves the window
+    else if ((sensor->noise > NOISE_NOISY) && (sensor->window_shift > 0))
+        sensor->window_shift--; // Noisy, doubles the window
+}
+#endif
+
 // Here is done all the Inttelligent work. This function checks the history buffers
 // to say wether the key was pressed or not.
 uint32_t capacitive_sensor_pressed(const capacitive_sensor_ptr_t sensors, const uint8_t num) {
     uint8_t sensor_id; // counter through sensors array
-    uint8_t buffer_to_fill[num];
-    uint8_t to_probe[num];
+    uint8_t to_probe[SENSORS_NUM(num)];
     uint8_t last_status; // Button status, pressed / released
+    uint8_t cond[SENSORS_NUM(num)]; // result of sensor_conditions
+    uint8_t action; // decision for the conditions of a sensor
+    uint32_t gray_zone; // next time in gray zone
     uint32_t retval;
-    circular_buffer_sum_t temp;
+    uint32_t now; // capacitive_clock after the readings, the same for all the sensors
+    const uint32_t press_lockout = CAPACITIVE_CLOCK_TICKS(PRESS_LOCKOUT_US);
+    const uint32_t release_hold = CAPACITIVE_CLOCK_TICKS(RELEASE_HOLD_US);
 
+#if defined(USE_BASELINE_TRACKING) || defined(USE_THRESHOLD_TRACKING)
+    (void)to_probe; // No probe here, thresholds are updated after the decisions
+#    ifndef USE_STREAMING_SAMPLER // Else buffers are filled in background
+    fill_sensors(sensors, num); // Fills buffer of readings FOR ALL THE BUTTONS
+#    endif
+#else // neither tracking defined
     memset(to_probe, 0, sizeof(to_probe));
-    for (sensor_id = 0; sensor_id < num; sensor_id++) {
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) {
         if (sensors[sensor_id].to_probe) {
             to_probe[sensor_id] = 1; // informs to execute probing
             sensors[sensor_id].to_probe = 0;
             sensors[sensor_id].gray_zone = 0; // no more in grayzone
         }
     }
+
+#ifdef USE_STREAMING_SAMPLER
+    // Buffers are filled in background. Only probed sensors need fresh readings
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++)
+        if (to_probe[sensor_id]) break;
+    if (sensor_id < SENSORS_NUM(num)) { // At least one sensor to probe
+        stream_paused = 1; // Thresholds are going to change, stops the sampler
+        probe(sensors, to_probe, num); // re-probes what needed, refills their buffers too
+        stream_paused = 0;
+    }
+#else
     probe(sensors, to_probe, num); // re-probes what needed
 
-    memset(buffer_to_fill, BUFFER_BOTH, sizeof(buffer_to_fill)); // Buffer to fill is an uint8_t array
-    fill_buffer(sensors, buffer_to_fill, num); // Fills buffer of readings FOR ALL THE BUTTONS
+    fill_sensors(sensors, num); // Fills buffer of readings FOR ALL THE BUTTONS
+#endif
+#endif // USE_BASELINE_TRACKING, USE_THRESHOLD_TRACKING
 
+    sensor_conditions(sensors, cond, num);
+    now = capacitive_clock();
     retval = 0; // now have to choose retval
-    for (sensor_id = 0; sensor_id < num; sensor_id++) { // sequentially for each sensor
+    UNROLL_SENSORS
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++) { // sequentially for each sensor
         last_status = sensors[sensor_id].pressed; // Stores last button status
 
-        temp = circular_buffer_sum(sensors[sensor_id].low_buffer);
-        if (temp <= SAMPLES_NUM*RELEASE_CONDITION) { // Key release, sends keyrelease and probes again
-            sensors[sensor_id].hysteresis_b++;
-            if (sensors[sensor_id].hysteresis_b >= HYSTERESIS_B) { // Actually send keyrelease
+        action = pgm_read_byte_near(decisions + cond[sensor_id]); // Everything to do, in one lookup
+
+        if (sensors[sensor_id].locked && (now - sensors[sensor_id].debounce >= press_lockout))
+            sensors[sensor_id].locked = 0; // Checked every tick, so it ends before the clock wraps
+
+        if (action & ACTION_RELEASE) { // Key release, sends keyrelease and probes again
+            if (!sensors[sensor_id].releasing) { // Release condition starts now
+                sensors[sensor_id].releasing = 1;
+                sensors[sensor_id].debounce = now;
+            }
+            if (now - sensors[sensor_id].debounce >= release_hold) { // Actually send keyrelease
                 sensors[sensor_id].pressed = 0; // Key is no more pressed
                 sensors[sensor_id].to_probe = 1; // Need another probe, as usual
-                sensors[sensor_id].hysteresis_b = 0; // Resets before hysteresis
-                sensors[sensor_id].hysteresis_a = HYSTERESIS_A; // This must decrease to zero
-            }
-            sensors[sensor_id].gray_zone = 0; // This is not  a greyzone
-        } else if (temp <= SAMPLES_NUM*LOW_THRESHOLD) {
-            sensors[sensor_id].gray_zone++; // it is not a keypress, but it is near to a keypress
-            if (sensors[sensor_id].gray_zone >= MAX_TIME_IN_GRAYZONE) { // Spent too many time in grayzone, request re-probe without sending keypress
-                sensors[sensor_id].to_probe = 1; // Too many time in grayzone means to probe again
-                sensors[sensor_id].pressed = 0; // Resets pressed status
+                sensors[sensor_id].releasing = 0;
+                sensors[sensor_id].locked = 1; // Lockout starts now
+                sensors[sensor_id].debounce = now;
             }
         } else {
-            sensors[sensor_id].gray_zone = 0;
+            sensors[sensor_id].releasing = 0; // Release condition must hold without breaks
+        }
+        // it is not a keypress, but it is near to a keypress. Too many time in grayzone means to probe again
+        if ((action & ACTION_LOW_GRAY) && (sensors[sensor_id].gray_zone + 1 >= MAX_TIME_IN_GRAYZONE)) {
+            sensors[sensor_id].to_probe = 1; // request re-probe without sending keypress
+            sensors[sensor_id].pressed = 0; // Resets pressed status
+        }
+        if ((action & ACTION_PRESS) && !sensors[sensor_id].locked) { // Key press, send kaypress and probes again sensibility
+            sensors[sensor_id].pressed = 1; // now button is pressed
+            sensors[sensor_id].releasing = 0; // inits debounce for keyrelease
+            sensors[sensor_id].to_probe = 1;
         }
 
-        temp = circular_buffer_sum(sensors[sensor_id].high_buffer);
-        if (temp >= SAMPLES_NUM*PRESS_CONDITION) { // Key press, send kaypress and probes again sensibility
-            if (sensors[sensor_id].hysteresis_a <= 0) { // 
-                sensors[sensor_id].pressed = 1; // now button is pressed
-                sensors[sensor_id].hysteresis_a = 0; 
-                sensors[sensor_id].hysteresis_b = 0; // inits hysteresys for keyrelease
-                sensors[sensor_id].to_probe = 1;
-            } else { // hysteresis_a not zero, must decrease first
-                sensors[sensor_id].hysteresis_a--;
-            }
-            sensors[sensor_id].gray_zone = 0; // This is not a grayzone
-        } else if (temp >= SAMPLES_NUM*HIGH_THRESHOLD) { // gray_zone
-            sensors[sensor_id].gray_zone++; // it is not a keypress, but it is near to a keypress
-            if (sensors[sensor_id].gray_zone >= MAX_TIME_IN_GRAYZONE) { // Spent too many time in grayzone, request re-probe without sending keypress
-                sensors[sensor_id].to_probe = 1;
-                sensors[sensor_id].pressed = 0; // Resets pressed status
-            }
-        } else { // Everything normal
-            sensors[sensor_id].gray_zone = 0;
+        gray_zone = ((action & ACTION_GRAY_KEEP) ? sensors[sensor_id].gray_zone : 0) + ACTION_GRAY_ADD(action);
+        if ((action & ACTION_HIGH_GRAY) && (gray_zone >= MAX_TIME_IN_GRAYZONE)) { // Same as above
+            sensors[sensor_id].to_probe = 1;
+            sensors[sensor_id].pressed = 0; // Resets pressed status
         }
+        sensors[sensor_id].gray_zone = gray_zone;
+#ifdef USE_ADAPTIVE_WINDOW
+        adapt_window(sensors + sensor_id); // Window of the next tick
+#endif
 
+#ifndef USE_BASELINE_TRACKING // Baseline is frozen while pressed, low threshold does not move
         // Fixes a non-release button. If reaches an old threshold mode
         if (last_status == 1) // Button was initially pressed
             if (sensors[sensor_id].low_threshold <= sensors[sensor_id].released_threshold)
                 sensors[sensor_id].pressed = 0; // now button is pressed
+#endif
+
+#ifdef USE_SPRT
+        if (sensors[sensor_id].pressed != last_status) // Decided, next decision needs new evidence
+            sprt_restart(sensors + sensor_id);
+#endif
 
         // Now sets the retval
         if (sensors[sensor_id].pressed == 1) { // If after decision sensor has been pressed
@@ -380,38 +1065,79 @@ uint32_t capacitive_sensor_pressed(const capacitive_sensor_ptr_t sensors, const
         }
    } // end for
 
+#if defined(USE_BASELINE_TRACKING)
+    baseline_thresholds(sensors, num); // thresholds for the next tick
+#elif defined(USE_THRESHOLD_TRACKING)
+    track_thresholds(sensors, num); // thresholds for the next tick
+#endif
+
     return retval;
 }
 
-static void capacitive_sensor_init_no_probe(const capacitive_sensor_ptr_t sensors, const uint8_t pin_id) {
+static void capacitive_sensor_init_no_probe(const capacitive_sensor_ptr_t sensors, const uint8_t pin_id, const uint8_t index) {
+#if defined(USE_SLICED_HISTORY)
+    sensors->index = index; // Lane of the sensor in the histories
+    sliced_history_reset(low_slices[index / 8]); // Resets all the lanes, the other sensors are initialized too
+    sliced_history_reset(high_slices[index / 8]);
+#elif defined(USE_HISTORY_BUFFER)
+    (void)index;
+    history_reset(sensors->low_buffer);
+    history_reset(sensors->high_buffer);
+#else
+    (void)index;
     circular_buffer_init(sensors->low_buffer , sensors->low_buffer_data , SAMPLES_NUM);
     circular_buffer_init(sensors->high_buffer, sensors->high_buffer_data, SAMPLES_NUM);
-    sensors->hysteresis_b = sensors->hysteresis_a = 0; // Default init
+#endif
+    sensors->debounce = 0; // Default init
+    sensors->locked = sensors->releasing = 0; // No debounce running
+#ifdef USE_ADAPTIVE_WINDOW
+    sensors->noise = NOISE_NOISY; // Whole window, until the sensor proves clean
+    sensors->window_shift = 0;
+#endif
     sensors->released_threshold = 0; // Default init
     sensors->gray_zone = 0; // Default init
     sensors->to_probe = 1; // This will cleared during probe
     sensors->pressed = 0; // Button starts not pressed
+#ifdef USE_THRESHOLD_TRACKING
+    sensors->low_step = sensors->high_step = 0; // Not tracking, first calibration is a probe
+    sensors->low_up = sensors->high_up = 0;
+#endif
+#ifdef USE_SPRT
+    sensors->press_llr = sensors->release_llr = 0; // No evidence
+#endif
+#ifdef USE_BASELINE_TRACKING
+    sensors->baseline = 0; // Set by the first probe
+#endif
+#ifdef USE_NOISE_DELTAS
+    sample_ring_init(sensors->noise_ring, sensors->noise_data, NOISE_RING_LEN);
+#endif
     sensors->pin = pin_id; // Pins  to read. Make sure the pin is configured in low level configurations
+    capacitive_pin_init(&sensors->io, pin_id); // Resolved once, used by all the reads
+#ifdef USE_DISCHARGE_CALIBRATION
+    capacitive_pin_calibrate_discharge(&sensors->io); // Before the probe, it reads with the measured time
+#endif
     sensors->high_threshold = sensors->low_threshold = 0; // Should change when probing
 }
 
+#ifndef CAPACITIVE_SENSORS_NUM // probe would read CAPACITIVE_SENSORS_NUM sensors
 void capacitive_sensor_init(const capacitive_sensor_ptr_t sensors, const uint8_t pin_id) {
     uint8_t to_probe = 1; /* pseudo-array */
     // This before everything
     inint_inputs(&pin_id, 1); // Inits capacitive inputs (lowlevel)
-    capacitive_sensor_init(sensors, pin_id);
+    capacitive_sensor_init_no_probe(sensors, pin_id, 0);
     probe(sensors, &to_probe, 1); // chooses correct threshold
 }
+#endif
 
 void capacitive_sensor_inits(const capacitive_sensor_ptr_t sensors, const uint8_t * const pin_id, const uint8_t num) {
     uint8_t sensor_id;
-    uint8_t to_probe[num];
+    uint8_t to_probe[SENSORS_NUM(num)];
 
     // This before everything
     inint_inputs(pin_id, num); // Inits capacitive inputs (lowlevel)
 
-    for (sensor_id = 0; sensor_id < num; sensor_id++)
-        capacitive_sensor_init_no_probe(sensors + sensor_id, pin_id[sensor_id]);
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++)
+        capacitive_sensor_init_no_probe(sensors + sensor_id, pin_id[sensor_id], sensor_id);
     memset(to_probe, 1, sizeof(to_probe)); // Every input has to be probed
     probe(sensors, to_probe, num); // chooses correct threshold
 }
@@ -419,13 +1145,13 @@ void capacitive_sensor_inits(const capacitive_sensor_ptr_t sensors, const uint8_
 // Progmem version of the function
 void capacitive_sensor_inits_P(const capacitive_sensor_ptr_t sensors, const uint8_t * const pin_id, const uint8_t num) {
     uint8_t sensor_id;
-    uint8_t to_probe[num];
+    uint8_t to_probe[SENSORS_NUM(num)];
 
     // This before everything
     inint_inputs_P(pin_id, num); // Inits capacitive inputs (lowlevel)
 
-    for (sensor_id = 0; sensor_id < num; sensor_id++)
-        capacitive_sensor_init_no_probe(sensors + sensor_id, pgm_read_byte_near(pin_id + sensor_id));
+    for (sensor_id = 0; sensor_id < SENSORS_NUM(num); sensor_id++)
+        capacitive_sensor_init_no_probe(sensors + sensor_id, pgm_read_byte_near(pin_id + sensor_id), sensor_id);
     memset(to_probe, 1, sizeof(to_probe)); // Every input has to be probed
     probe(sensors, to_probe, num); // chooses correct threshold
 }
@@ -26,68 +26,382 @@
 #include <stdint.h> // uint8_t type
 #include <string.h> // memcpy, memmmove
 #include <stddef.h> // NULL pointer
+#include <limits.h> // CHAR_BIT
 #include <avr/pgmspace.h>
 
 #include "cpu.h" // Almost all the needed to work with AVR controller
 #include "capacitive.h" // function defined in this code
 #include "pin_utils.h" // id_to_pin function
+#include "capacitive_kernels.h" // per pin reading kernels
 #include "capacitive_settings.h" // capacitive settings
 
 // Note: inline will not work between multiple files unless LTO is enabled (compile with -flto)
-static uint8_t portb_bitmask, portc_bitmask, portd_bitmask, portf_bitmask; // input bitmask (1 input, 0 no input)
-static uint8_t portb_used_mask, portc_used_mask, // automagic discharge when necessary
-               portd_used_mask, portf_used_mask;
-static uint8_t _threshold;
+// Indexed by port id, the last one is used by non existing pins (always 0)
+static uint8_t port_bitmask[PIN_PORTS_NUM + 1]; // input bitmask (1 input, 0 no input)
+static volatile uint8_t port_used_mask[PIN_PORTS_NUM + 1]; // automagic discharge when necessary
+static capacitive_threshold_t _threshold; // Charge window in cycles (see CAPACITIVE_WINDOW)
+
+#ifdef USE_THRESHOLD_DITHER
+_Static_assert((DITHER_BITS >= 1) && (DITHER_BITS <= 6), "DITHER_BITS must be in [1 - 6]");
+static uint16_t dither_lfsr = 0xACE1; // Galois LFSR (x^16 + x^14 + x^13 + x^11 + 1), never 0
+static uint8_t dither_paused; // Set while calibrating, reads are at the exact threshold
+
+// Offset of the next charge, uniform in [-2^(DITHER_BITS-1), 2^(DITHER_BITS-1)). The mean is -1/2 cycle,
+// so a window of readings averages back to about the set threshold. DITHER_BITS fresh bits per charge
+static int8_t dither_next(void) {
+    uint8_t i;
+
+    for (i = 0; i < DITHER_BITS; i++)
+        dither_lfsr = (dither_lfsr >> 1) ^ (-(dither_lfsr & 1) & 0xB400u);
+    return (int8_t)(dither_lfsr & ((1 << DITHER_BITS) - 1)) - (1 << (DITHER_BITS - 1));
+}
+
+// threshold + offset, clamped to the threshold range
+static capacitive_threshold_t dithered(const capacitive_threshold_t threshold, const int8_t offset) {
+    if ((offset < 0) && (threshold < (capacitive_threshold_t)-offset))
+        return 0;
+    if ((offset > 0) && (threshold > (capacitive_threshold_t)~0 - offset))
+        return (capacitive_threshold_t)~0;
+    return threshold + offset;
+}
+#endif // USE_THRESHOLD_DITHER
+
+// ====== ALL THE 'HARD WORK' IS DONE HERE ======
+// ====== WARNING: DO NOT REMOVE CAP_DISCHARGE(); FUNCTION =====
+
+// N.B. _MemoryBarrier function forces r/w to follow the order. It should not slow down execution
+#define CAP_CHARGHE(_pin) do {                                                                                      \
+    _MemoryBarrier();                                                                                               \
+    *(_pin.ddr) &= ~(_pin.bitmask); /* Make the port an input (connect internal resistor) */                        \
+    _MemoryBarrier();                                                                                               \
+    *(_pin.port) |= _pin.bitmask; /* writes 1 on the pin (port is a pull-up). Capacitor charging starts now */      \
+    _MemoryBarrier();                                                                                               \
+} while (0)
 
+/* Performs the reading */
+#define CAP_READ(_pin) (*(_pin.pin) & _pin.bitmask) //  N.B Keep _pin on the local stack, this way gains in speed
+
+/* discharge port, it is important to leave the pis low if you want to do multiple readings
+   discharge port function should do the same thing on all the pins, but it is safer to do it just after reading */
+#define CAP_DISCHARGHE(_pin) do {                                                                                  \
+    _MemoryBarrier(); /* WARNING: Keep the order of the following two */                                            \
+    *(_pin.port) &= ~(_pin.bitmask); /* wirtes 0 */                                                                 \
+    _MemoryBarrier();                                                                                               \
+    *(_pin.ddr) |= _pin.bitmask; /* port is now an output (disconnect internal resistor) */                         \
+    _MemoryBarrier();                                                                                               \
+} while (0)
+
+// ====== DISCHARGE CLOCK ======
+// Timer 3 runs free at cpu clock / 8 (2 ticks per us, wraps every 32ms). Each discharge stores
+// the tick when it will be complete, so a read waits only the time its pins still need
+// Its overflows are counted too, extending it to the 32 bits capacitive_clock
+#include "timer_utils.h" // many timer functions
+#include <util/atomic.h> // Atomic functions (i.e. disabling interrupts)
+#include <avr/interrupt.h> // ISR macro
+
+#ifdef USE_DISCHARGE_CALIBRATION // Longest discharge a pin may get
+#   define DISCHARGE_LONGEST DISCHARGE_TIME_MAX
+#else
+#   define DISCHARGE_LONGEST DISCHARGE_TIME
+#endif
+#define DISCHARGE_TICKS ((uint16_t)((double)DISCHARGE_TIME/1E6 * F_CPU/8.0 + 0.999)) // Rounded up
+#define DISCHARGE_TICKS_MAX ((uint16_t)((double)DISCHARGE_LONGEST/1E6 * F_CPU/8.0 + 0.999))
+_Static_assert(DISCHARGE_TICKS <= DISCHARGE_TICKS_MAX, "DISCHARGE_TIME_MAX must be at least DISCHARGE_TIME");
+_Static_assert(DISCHARGE_TICKS_MAX < 0x8000, "DISCHARGE_TIME too long for Timer 3 clock");
+static uint16_t discharge_deadline[PIN_PORTS_NUM + 1][CHAR_BIT]; // Indexed by port id and pin bit
+static uint16_t discharge_ticks[PIN_PORTS_NUM + 1][CHAR_BIT] = { // Discharge time of each pin, same indexes
+    [0 ... PIN_PORTS_NUM] = { [0 ... CHAR_BIT - 1] = DISCHARGE_TICKS } // Measured by capacitive_pin_calibrate_discharge
+};
+
+static void discharge_clock_init(void) {
+    static uint8_t timer_initialized = 0;
+
+    if (timer_initialized == 0) { // Executes this only one time
+        timer_enable(TIMER_ID_3);
+        timer_init(TIMER_ID_3, TIMER_SOURCE_CLK_8, // Sets cpu clock / 8 tick frequency
+                   TIMER_MODE_NORMAL, // Free running
+                   OUT_MODE_NORMAL_A | OUT_MODE_NORMAL_B); // Not used output
+        timer_init_interrupt(TIMER_ID_3, TIMER_INTERRUPT_MODE_TOI); // Counts the overflows
+        timer_start(TIMER_ID_3);
+        timer_initialized = 1; // All done for now.
+    }
+}
+
+static volatile uint16_t clock_overflows = 0; // High half of capacitive_clock
+
+ISR(TIMER3_OVF_vect) {
+    clock_overflows++;
+}
+
+uint32_t capacitive_clock(void) {
+    uint16_t now, high;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { // 16 bits read, and the overflow must not run in the middle
+        now = timer3_count(NULL);
+        high = clock_overflows;
+        if ((TIFR3 & _BV(TOV3)) && (now < 0x8000)) // Wrapped, but the ISR has not run yet
+            high++;
+    }
+    return ((uint32_t)high << 16) | now;
+}
+
+// Timer 3 count, the clock of the discharge deadlines
 static inline
-void can_now_use_pin(pin_t pin) {
-    if (pin.port == &PORTB)
-        portb_used_mask &= (~pin.bitmask); // Clears only that bit
-    else if (pin.port == &PORTC)
-        portc_used_mask &= (~pin.bitmask); // Clears only that bit
-    else if (pin.port == &PORTD)
-        portd_used_mask &= (~pin.bitmask); // Clears only that bit
-    else if (pin.port == &PORTF)
-        portf_used_mask &= (~pin.bitmask); // Clears only that bit
+uint16_t discharge_clock(void) {
+    uint16_t now;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { // 16 bits read, the ISR uses the same TEMP register
+        now = timer3_count(NULL);
+    }
+    return now;
+}
+
+// Ticks still needed to complete the discharge, 0 if done
+// Deadlines more than DISCHARGE_TICKS_MAX ahead are stale (the clock wrapped since), so they are done too
+static inline
+uint16_t discharge_remaining(const uint16_t deadline) {
+    const uint16_t remaining = deadline - discharge_clock();
+    return (remaining > DISCHARGE_TICKS_MAX) ? 0 : remaining;
+}
+
+// Waits until the pins have been discharged (bits of pin are on the same port)
+static void wait_discharge(const capacitive_pin_t * const pin) {
+    const uint16_t * const deadline = discharge_deadline[pin->port_id];
+    uint8_t i, bit, pending = *pin->used_mask & pin->pin.bitmask;
+
+    for (i = 0, bit = 1; pending != 0; i++, bit <<= 1) {
+        if (!(pending & bit)) continue;
+        pending &= ~bit;
+        while (discharge_remaining(deadline[i]) != 0); // busy wait, only the time still needed
+    }
 }
 
 #ifdef USE_DISCHARGE_TIMERS
-#   include "timer_utils.h" // many timer functions
-#   include <util/atomic.h> // Atomic functions (i.e. disabling interrupts)
-#   include <avr/interrupt.h> // ISR macro
 
-    static uint16_t waiting_ocra[MAX_PORT_NUM]; // Will hold Compare register for each port
-    static pin_t waiting_pin_no[MAX_PORT_NUM - 1]; // Holds pin number
-    static pin_t last_pin; // Holds last pin
-    static uint8_t waiting = 0; // Number of pin waiting
+    // Pins waiting for their discharge
+    typedef struct {
+        uint16_t deadline; // discharge end
+        uint8_t port_id; // port of the pins
+        uint8_t bitmask; // pins (all of them on the same port)
+    } discharge_t;
+
+    // Single producer (reads) single consumer (ISR) ring, in order. A short discharge queued after a
+    // longer one is released with it, its reads check its own deadline in the meantime
+    // Counters run free, the slot is counter % DISCHARGE_QUEUE_LEN. Only the producer writes tail,
+    // only the ISR writes head, so no lock is needed
+    _Static_assert((DISCHARGE_QUEUE_LEN & (DISCHARGE_QUEUE_LEN - 1)) == 0, "DISCHARGE_QUEUE_LEN must be a power of 2");
+    static discharge_t waiting_pin_no[DISCHARGE_QUEUE_LEN];
+    static volatile uint8_t waiting_head = 0, waiting_tail = 0;
+    static volatile uint8_t waiting_seq[PIN_PORTS_NUM + 1][CHAR_BIT]; // Counter of the last discharge of each pin
+
+    // Clears the used bits. Pins read again in the meantime have a newer discharge, they are left used
+    static inline
+    void can_now_use_pin(const discharge_t * const pin, const uint8_t seq) {
+        uint8_t i, bit;
+        for (i = 0, bit = 1; i < CHAR_BIT; i++, bit <<= 1)
+            if ((pin->bitmask & bit) && (waiting_seq[pin->port_id][i] == seq))
+                port_used_mask[pin->port_id] &= ~bit; // Clears only that bit
+    }
 
-    // TIMER ISR
+    // TIMER ISR, compare A is the deadline of the first waiting pins
     ISR(TIMER3_COMPA_vect) {
-        uint16_t new_compare;
-
-        timer_stop(TIMER_ID_3); // Stops the timer for a while
-        if (waiting != 0) {
-            new_compare = timer3_compare(TIMER_COMP_A, NULL); // Gers current compare
-            new_compare -= waiting_ocra[0]; // USes the first aviable
-            timer3_compare(TIMER_COMP_A, &new_compare); // Sets new_compare
-            can_now_use_pin(last_pin);
-            // Moves data
-            last_pin = waiting_pin_no[0];
-            waiting--; // One less data in the queue
-            memmove(waiting_ocra, waiting_ocra + 1, sizeof(*waiting_ocra)*waiting);
-            memmove(waiting_pin_no, waiting_pin_no + 1, sizeof(*waiting_pin_no)*waiting);
-            timer_start(TIMER_ID_3); // Restarts the timer
-        } else {
-            // No more waiting pins, stops the timer
-            // (timer is stopped, do not restart!)
-            can_now_use_pin(last_pin);
+        uint8_t head = waiting_head;
+        discharge_t * pin;
+
+        while (head != waiting_tail) {
+            pin = waiting_pin_no + (head % DISCHARGE_QUEUE_LEN);
+            if (discharge_remaining(pin->deadline) != 0) { // Still discharging
+                timer3_compare(TIMER_COMP_A, &pin->deadline);
+                if (discharge_remaining(pin->deadline) != 0)
+                    break; // Wait for it. Else deadline passed while setting compare, done now
+            }
+            can_now_use_pin(pin, head);
+            head++; // One less data in the queue
         }
+        waiting_head = head;
+        if (head == waiting_tail)
+            TIMSK3 &= ~(_BV(OCIE3A)); // No more waiting pins, stops the interrupt
     }
 
 #endif // USE_DISCHARGE_TMERS not defined
 
+#if defined(USE_PCINT_CHARGE_TIME) || defined(USE_INPUT_CAPTURE)
+#   include <avr/interrupt.h> // ISR macro
+#   include <avr/sleep.h> // CPU Sleep modes, waits the interrupts
+
+    // 1 while the CPU sleeps, cleared by the first instruction after the wake up. AVR executes one
+    // instruction after each ISR returns, so an ISR that finds it set is the first one since the sleep
+    static volatile uint8_t sleeping = 0;
+
+    // Sleeps until an interrupt clears the flag
+    // Interrupts are enabled while sleeping (i.e. also during init), then restored
+    static void sleep_while(volatile uint8_t * const flag) {
+        uint8_t old_SREG = SREG; // to store interrupt configuration
+
+        set_sleep_mode(SLEEP_MODE_IDLE); // Idle mode does not disable any interrupt
+        while (1) {
+            cli();
+            if (*flag == 0) break;
+            sleeping = 1;
+            sleep_enable();
+            sei(); // Next instruction is executed before any interrupt, so no wake up is lost
+            __asm__ __volatile__ (
+                "sleep"                          "\n\t"
+                "sts %[sleeping], __zero_reg__"  "\n\t" // Single instruction, runs before the next ISR
+                : : [sleeping] "i" (&sleeping) : "memory");
+            sleep_disable();
+        }
+        SREG = old_SREG; // re-enable interrupts (if enabled)
+    }
+#endif
+
+#ifdef USE_PCINT_CHARGE_TIME
+
+    static volatile uint8_t pcint_pending = 0; // PORTB pins still charging
+    static volatile uint8_t pcint_start; // Timer 0 count when the charge started
+    static volatile uint8_t pcint_times[CHAR_BIT]; // Charge time of each PORTB pin
+    static volatile uint8_t pcint_late; // Pins timestamped after another interrupt, their times are too long
+
+    // Stores the charge time of the pending pins that are now high
+    static inline void pcint_collect(const uint8_t now, const uint8_t late) {
+        uint8_t charged, bit, i;
+
+        charged = PINB & pcint_pending; // Pins charged since last time
+        pcint_pending &= ~charged;
+        if (late)
+            pcint_late |= charged;
+        for (i = 0, bit = 1; charged != 0; i++, bit <<= 1) {
+            if (charged & bit) {
+                pcint_times[i] = now - pcint_start;
+                charged &= ~bit;
+            }
+        }
+        if (pcint_pending == 0) { // All done, stops the interrupts
+            PCMSK0 = 0;
+            TIMSK0 &= ~(_BV(OCIE0A));
+        }
+    }
+
+    // A pin on PORTB changed. Timestamp as soon as possible
+    // If the CPU was not sleeping, another interrupt (i.e. USB) may have run when the pin charged,
+    // and its whole latency would be counted: the pins are marked late
+    ISR(PCINT0_vect) {
+        const uint8_t now = TCNT0;
+        pcint_collect(now, !sleeping);
+    }
+
+    // Timeout, the remaining pins did not charge
+    ISR(TIMER0_COMPA_vect) {
+        pcint_pending = 0; // charge time stays CHARGE_TIME_MAX
+        PCMSK0 = 0;
+        TIMSK0 &= ~(_BV(OCIE0A));
+    }
+
+    // Charges the group (it must be on PORTB) and sleeps until all the pins are charged.
+    // Timer 0 runs free at cpu clock, so times are in cpu cycles (plus the interrupt latency)
+    // Pins in pcint_late must be measured again (see capacitive_pins_measure)
+    static void pcint_measure_group(const pin_t group) {
+        static uint8_t timer_initialized = 0;
+        uint8_t i, timeout;
+
+        if (timer_initialized == 0) { // Executes this only one time
+            timer_enable(TIMER_ID_0);
+            timer_init(TIMER_ID_0, TIMER_SOURCE_CLK, // Sets cpu clock tick frequency
+                       TIMER_MODE_NORMAL, // Free running
+                       OUT_MODE_NORMAL_A | OUT_MODE_NORMAL_B); // Not used output
+            timer_start(TIMER_ID_0);
+            PCICR |= _BV(PCIE0); // Pin change interrupts on PORTB, masked by PCMSK0
+            timer_initialized = 1; // All done for now.
+        }
+
+        for (i = 0; i < CHAR_BIT; i++)
+            pcint_times[i] = CHARGE_TIME_MAX; // Stays so if the pin never charges
+
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            pcint_pending = group.bitmask;
+            pcint_late = 0;
+            PCMSK0 = group.bitmask; // Only the pins of this group
+            PCIFR = _BV(PCIF0); // Clears old changes (writing 1 clears the flag)
+            pcint_start = TCNT0;
+            timeout = pcint_start + CHARGE_TIME_MAX;
+            timer0_compare(TIMER_COMP_A, &timeout);
+            TIFR0 = _BV(OCF0A); // Free running timer, the flag may be set from a previous round
+            TIMSK0 |= _BV(OCIE0A);
+            CAP_CHARGHE(group); // Charge starts now
+            pcint_collect(TCNT0, 0); // Pins already high will not change anymore
+        }
+
+        sleep_while(&pcint_pending); // the CPU is free to serve other interrupts (i.e. USB)
+        CAP_DISCHARGHE(group);
+    }
+#endif // USE_PCINT_CHARGE_TIME
+
+#ifdef USE_INPUT_CAPTURE
+    static volatile uint8_t icp_waiting = 0; // True until the capture (or the timeout)
+    static volatile uint16_t icp_capture; // Timer 1 count when the pin charged
+
+    // Called by Timer 1 capture ISR
+    static void icp_captured(const uint16_t capture) {
+        icp_capture = capture;
+        icp_waiting = 0;
+        TIMSK1 &= ~(_BV(ICIE1) | _BV(OCIE1B)); // Stops the capture and the timeout
+    }
+
+    // Timeout, the pin did not charge (capture is left to its default)
+    ISR(TIMER1_COMPB_vect) {
+        icp_waiting = 0;
+        TIMSK1 &= ~(_BV(ICIE1) | _BV(OCIE1B)); // Stops the capture and the timeout
+    }
+
+    // Charges the pin on ICP1 and sleeps until Timer 1 captures the rising edge.
+    // Timer 1 must count cpu cycles in CTC mode (top is OCR1A), returns cpu cycles
+    static uint8_t icp_measure_pin(const pin_t pin) {
+        static uint8_t capture_initialized = 0;
+        uint16_t start, timeout, top, elapsed;
+
+        if (capture_initialized == 0) { // Executes this only one time
+            timer_init_capture(TIMER_ID_1, TIMER_CAPTURE_RISING | TIMER_CAPTURE_NOISE_CANCEL);
+            timer_capture_handler(TIMER_ID_1, &icp_captured);
+            capture_initialized = 1;
+        }
+
+        top = timer1_compare(TIMER_COMP_A, NULL); // Timer 1 restarts from 0 after top
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            icp_waiting = 1;
+            start = timer1_count(NULL);
+            icp_capture = start + CHARGE_TIME_MAX; // Used on timeout
+            timeout = start + CHARGE_TIME_MAX;
+            if ((timeout > top) || (timeout < start)) // wraps as the timer does
+                timeout -= top + 1;
+            timer1_compare(TIMER_COMP_B, &timeout);
+            TIFR1 = _BV(ICF1) | _BV(OCF1B); // Clears old events (writing 1 clears the flag)
+            TIMSK1 |= _BV(ICIE1) | _BV(OCIE1B);
+            CAP_CHARGHE(pin); // Charge starts now
+            if (CAP_READ(pin)) { // Already high, there will be no edge
+                icp_capture = start;
+                icp_waiting = 0;
+                TIMSK1 &= ~(_BV(ICIE1) | _BV(OCIE1B));
+            }
+        }
+
+        sleep_while(&icp_waiting); // Hardware does the timing, CPU is free
+        CAP_DISCHARGHE(pin);
+
+        elapsed = icp_capture - start;
+        if (icp_capture < start) // Timer restarted from 0 in the meantime
+            elapsed -= ~top; // i.e. elapsed += top + 1
+        return (elapsed < CHARGE_TIME_MAX) ? elapsed : CHARGE_TIME_MAX;
+    }
+#endif // USE_INPUT_CAPTURE
+
 /* check pin low level function */
-static inline uint8_t check_pin(pin_t pin) __attribute__((always_inline));
+#ifdef USE_CHARGE_TIME
+static uint8_t measure_group(const capacitive_pin_t * const group, uint8_t * counts, uint8_t * states);
+#endif
+#ifdef USE_PORT_PARALLEL_READ
+static void read_group(const capacitive_pin_t * const group, const capacitive_threshold_t * delays, uint8_t * snapshots, uint8_t len);
+#else
+static uint8_t check_pin(const capacitive_pin_t * const pin, capacitive_threshold_t threshold);
+#endif
 
 void inint_inputs(const uint8_t inputs[], const uint8_t inputs_len)
 {
@@ -95,20 +409,14 @@ void inint_inputs(const uint8_t inputs[], const uint8_t inputs_len)
     uint8_t i; // counter
 
     // Automatically sets up input ports bitmask
-    portb_bitmask = portc_bitmask = portd_bitmask = portf_bitmask = 0; // sets all to zero
+    memset(port_bitmask, 0, sizeof(port_bitmask)); // sets all to zero
     for (i = 0; i < inputs_len; i++) { // for each input
         temp = id_to_pin(inputs[i]);
-        if (temp.port == &PORTB)
-            portb_bitmask |= temp.bitmask;
-        if (temp.port == &PORTC)
-            portc_bitmask |= temp.bitmask;
-        if (temp.port == &PORTD)
-            portd_bitmask |= temp.bitmask;
-        if (temp.port == &PORTF)
-            portf_bitmask |= temp.bitmask;
+        port_bitmask[pin_port_id(temp)] |= temp.bitmask; // Non existing pins have no bits
     }
 
     set_threshold(START_THRESHOLD);
+    discharge_clock_init(); // Times the discharges
     discharge_ports(); // complete the setup by making ports readable
 }
 
@@ -119,229 +427,587 @@ void inint_inputs_P(const uint8_t inputs[], const uint8_t inputs_len)
     uint8_t i; // counter
 
     // Automatically sets up input ports bitmask
-    portb_bitmask = portc_bitmask = portd_bitmask = portf_bitmask = 0; // sets all to zero
+    memset(port_bitmask, 0, sizeof(port_bitmask)); // sets all to zero
     for (i = 0; i < inputs_len; i++) { // for each input
         temp = id_to_pin(pgm_read_byte_near(inputs + i));
-        if (temp.port == &PORTB)
-            portb_bitmask |= temp.bitmask;
-        if (temp.port == &PORTC)
-            portc_bitmask |= temp.bitmask;
-        if (temp.port == &PORTD)
-            portd_bitmask |= temp.bitmask;
-        if (temp.port == &PORTF)
-            portf_bitmask |= temp.bitmask;
+        port_bitmask[pin_port_id(temp)] |= temp.bitmask; // Non existing pins have no bits
     }
 
     set_threshold(START_THRESHOLD);
+    discharge_clock_init(); // Times the discharges
     discharge_ports(); // complete the setup by making ports readable
 }
 
 // threshold functions
-void set_threshold(uint8_t new_sens) { _threshold = new_sens; }
-uint8_t get_threshold(void) { return _threshold; }
+void set_threshold(capacitive_threshold_t new_sens) { _threshold = new_sens; }
+capacitive_threshold_t get_threshold(void) { return _threshold; }
 
 void discharge_ports(void)
 {
+    uint8_t i; // counter
+
     // Write 0 on the keyboard pins
-    PORTB &= ~(portb_bitmask);
-    PORTC &= ~(portc_bitmask);
-    PORTD &= ~(portd_bitmask);
-    PORTF &= ~(portf_bitmask);
+#define DISCHARGE_WRITE_0(P) PORT ## P &= ~(port_bitmask[PIN_PORT_ID_ ## P]);
+    PIN_PORTS_FOREACH(DISCHARGE_WRITE_0)
+#undef DISCHARGE_WRITE_0
     _MemoryBarrier();
 
     // and make output the input (to remove internal resistance)
-    DDRB |= portb_bitmask;
-    DDRC |= portc_bitmask;
-    DDRD |= portd_bitmask;
-    DDRF |= portf_bitmask;
+#define DISCHARGE_OUTPUT(P) DDR ## P |= port_bitmask[PIN_PORT_ID_ ## P];
+    PIN_PORTS_FOREACH(DISCHARGE_OUTPUT)
+#undef DISCHARGE_OUTPUT
     _MemoryBarrier();
 
     // wait some time, this way the capacitor connected get discharged
-    _delay_us(DISCHARGE_TIME);
+    _delay_us(DISCHARGE_LONGEST); // Pins may not be measured yet
 
     // ports are now usable
-    portb_used_mask = portc_used_mask = portd_used_mask = portf_used_mask = 0;
+    for (i = 0; i < sizeof(port_used_mask); i++)
+        port_used_mask[i] = 0;
     _MemoryBarrier();
 }
 
-uint8_t check_port(uint8_t in)
-{
-    pin_t pin; // comfortable pin structure
-    uint8_t ret_val; // return value
-    uint8_t old_SREG; // to store interrupt configuration
-    uint8_t * tmp_bitmask, * tmp_used_bitmask;
+// Resolves the pin once: registers, port index and masks of the port
+void capacitive_pin_init(capacitive_pin_t * const pin, const uint8_t id) {
+    pin->pin = id_to_pin(id);
+    pin->id = id;
+    pin->port_id = pin_port_id(pin->pin); // PIN_PORTS_NUM if the pin does not exist
+    pin->enabled_mask = port_bitmask + pin->port_id; // Masks of non existing port are always 0
+    pin->used_mask = port_used_mask + pin->port_id;
+#ifndef USE_PORT_PARALLEL_READ
+    pin->kernel = NULL;
+    if (id < capacitive_kernels_len)
+        pin->kernel = pgm_read_ptr_near(capacitive_kernels + id);
+#endif
+}
 
+// Stores when the discharge of pin will be complete. Pin has just been discharged
+// pin bitmask may contain more than one bit (all of them on the same port), each one with its own
+// discharge time. The timer waits the longest of them
+static inline
+void schedule_discharge(const capacitive_pin_t * const pin) {
+    const uint16_t now = discharge_clock();
+    const uint16_t * const ticks = discharge_ticks[pin->port_id];
+    uint8_t i, bit;
 #ifdef USE_DISCHARGE_TIMERS
-    static const uint16_t timer_comparator = ((double)DISCHARGE_TIME/1E6 * F_CPU)/1024.0; // 1024 = prescaler!
-    static uint8_t timer_initialized = 0;
-    static uint16_t last_timer_read = 0;
-    
-    if (timer_initialized == 0) { // Executes this only one time
-        // Inits timer 3
-        timer_enable(TIMER_ID_3);
-        timer_init(TIMER_ID_3, TIMER_SOURCE_CLK_1024, // Sets cpu clock / 1024 tick frequency
-                   TIMER_MODE_CTC_OCR, // When reaches Compare A resets
-                   OUT_MODE_NORMAL_A | OUT_MODE_NORMAL_B); // Not used output
-        timer_init_interrupt(TIMER_ID_3, TIMER_INTERRUPT_MODE_OCIA); // This enables interrupt, on compare A
-        // N.B. timer is now STOPPED
-        timer_initialized = 1; // All done for now.
-    }
+    const uint8_t tail = waiting_tail;
+    discharge_t * const slot = waiting_pin_no + (tail % DISCHARGE_QUEUE_LEN);
+    const uint8_t queued = (uint8_t)(tail - waiting_head) < DISCHARGE_QUEUE_LEN; // Not full
+    uint16_t deadline = now; // latest deadline of the pins
+#endif
+
+    for (i = 0, bit = 1; i < CHAR_BIT; i++, bit <<= 1) {
+        if (!(pin->pin.bitmask & bit)) continue;
+        discharge_deadline[pin->port_id][i] = now + ticks[i];
+#ifdef USE_DISCHARGE_TIMERS
+        waiting_seq[pin->port_id][i] = tail; // Older discharges will not clear the used bit
+        if ((uint16_t)(deadline - now) < ticks[i])
+            deadline = now + ticks[i];
 #endif
+    }
 
-    pin = id_to_pin(in); // Gets an usable pin data structure
+#ifdef USE_DISCHARGE_TIMERS
+    if (queued) { // Slot is not visible to the ISR until tail moves
+        slot->deadline = deadline;
+        slot->port_id = pin->port_id;
+        slot->bitmask = pin->pin.bitmask;
+    } // else: Simply do nothing, pins stay used and the next read checks their deadline
+#endif
+    _MemoryBarrier();
+    *pin->used_mask |= pin->pin.bitmask; // marks the pins as used, after their deadline is set
 
-    // Safety code: check the pin is enabled for capacitive
-    if (pin.port == &PORTB) {
-        tmp_bitmask = &portb_bitmask;
-        tmp_used_bitmask = &portb_used_mask;
-    } else if (pin.port == &PORTC) {
-        tmp_bitmask = &portc_bitmask;
-        tmp_used_bitmask = &portc_used_mask;
-    } else if (pin.port == &PORTD) {
-        tmp_bitmask = &portd_bitmask;
-        tmp_used_bitmask = &portd_used_mask;
-    } else if (pin.port == &PORTF) {
-        tmp_bitmask = &portf_bitmask;
-        tmp_used_bitmask = &portf_used_mask;
-    } else { // Should never happen
-        tmp_bitmask = NULL; // This will lead to an error
-        tmp_used_bitmask = NULL;
+#ifdef USE_DISCHARGE_TIMERS
+    if (queued) {
+        _MemoryBarrier();
+        waiting_tail = tail + 1; // Publishes the slot
+        _MemoryBarrier();
+        if (!(TIMSK3 & _BV(OCIE3A))) { // ISR is idle (and cannot run), starts it on this deadline
+            timer3_compare(TIMER_COMP_A, &deadline); // sets compare A
+            TIFR3 = _BV(OCF3A); // Clears old compare (writing 1 clears the flag)
+            TIMSK3 |= _BV(OCIE3A);
+        }
     }
+#endif
+}
+
+unsigned char check_port(uint8_t in)
+{
+    capacitive_pin_t pin; // comfortable pin structure
 
-    if ((tmp_bitmask == NULL) // pin does not exists
-            || !(*tmp_bitmask & pin.bitmask)) // pin not enabled
+    capacitive_pin_init(&pin, in); // Gets an usable pin data structure
+    return capacitive_pin_check(&pin);
+}
+
+unsigned char capacitive_pin_check(const capacitive_pin_t * const pin)
+{
+    uint8_t ret_val; // return value
+    uint8_t old_SREG; // to store interrupt configuration
+    capacitive_threshold_t threshold = _threshold; // same kernel of check_ports, so thresholds are comparable
+
+    // Safety code: check the pin is enabled for capacitive
+    if (!(*pin->enabled_mask & pin->pin.bitmask)) // pin not enabled (or does not exists)
         return -1; // Cannot use this port for capacitive sensor, error
 
     // Now check if can read the port
-    if ((tmp_used_bitmask == NULL) // This check might be unuseful
-            || (*tmp_used_bitmask & pin.bitmask)) // if port was used recently
-        discharge_ports(); // Cannot read data after use without a prior reset
-                           // so reset here, now can use the port
+    if (*pin->used_mask & pin->pin.bitmask) // if port was used recently
+        wait_discharge(pin); // Cannot read data before its discharge is complete
+                             // so waits here, only the time still needed
+
+#ifdef USE_THRESHOLD_DITHER
+    if (!dither_paused)
+        threshold = dithered(threshold, dither_next()); // Computed out of the critical section
+#endif
 
     // Now we are ready to actually read
     _MemoryBarrier();
     old_SREG = SREG; // Stores interrupt configuration
     SREG = 0; // disables interrupts for a while
 
-    ret_val = check_pin(pin); // time critical section, readng
+#ifdef USE_PORT_PARALLEL_READ
+    read_group(pin, &threshold, &ret_val, 1); // time critical section, reading
+    ret_val = !(ret_val & pin->pin.bitmask);
+#else
+    if (pin->kernel != NULL)
+        ret_val = pin->kernel(threshold); // time critical section, reading
+    else
+        ret_val = check_pin(pin, threshold); // time critical section, readng
+#endif
 
     SREG = old_SREG; // re-enable interrupts (if enabled)
 
-    // marks the port as used
-    if (tmp_used_bitmask != NULL)
-        *tmp_used_bitmask |= pin.bitmask;
+    schedule_discharge(pin); // also marks the port as used
 
-#ifdef USE_DISCHARGE_TIMERS
-    // Now starts a timer to discharge the port
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-        if (is_timer_running(TIMER_ID_3)) { // Someone else is waiting for a discharge
-        // Writes in the first free block, wich is waiting id
-            if (waiting < MAX_PORT_NUM) { // Everything OK
-                uint16_t tmp_read = timer3_count(NULL);
-                _MemoryBarrier();
-                waiting_ocra[waiting] = tmp_read - last_timer_read; // Difference with last read
-                last_timer_read = tmp_read; // Now this is last read
-                waiting_pin_no[waiting] = pin; // Waiting pin
-                waiting++;
-            } else {
-                // Cannot store that pin.
-                // Simply do nothing, the discharge_ports function
-                // will take care of this case automatically (but inefficently)
-            }
+    return !!ret_val; // binary return, or 1, or 0
+}
+
+#ifdef USE_DISCHARGE_CALIBRATION
+_Static_assert((DISCHARGE_CAL_READS % 2 == 1) && (DISCHARGE_CAL_READS <= UCHAR_MAX), "DISCHARGE_CAL_READS must be odd, in [1 - 255]");
+
+// Sets the discharge time of the pins (bits of pin are on the same port)
+static void set_discharge_ticks(const capacitive_pin_t * const pin, const uint16_t ticks) {
+    uint8_t i, bit;
+
+    for (i = 0, bit = 1; i < CHAR_BIT; i++, bit <<= 1)
+        if (pin->pin.bitmask & bit)
+            discharge_ticks[pin->port_id][i] = ticks;
+}
+
+// Reads pin at threshold DISCHARGE_CAL_READS times, each one after a charge of THRESHOLD_MAX cycles
+// (the longest window, worst case) discharged for ticks. Returns 1 if most of them had contact
+static uint8_t discharge_read(const capacitive_pin_t * const pin, const capacitive_threshold_t threshold, const uint16_t ticks) {
+    uint8_t i, contacts = 0;
+
+    set_discharge_ticks(pin, ticks);
+    for (i = 0; i < DISCHARGE_CAL_READS; i++) {
+        set_threshold(THRESHOLD_MAX);
+        capacitive_pin_check(pin); // Charges it, the next read waits ticks
+        set_threshold(threshold);
+        contacts += capacitive_pin_check(pin);
+    }
+    return contacts > DISCHARGE_CAL_READS / 2;
+}
+
+void capacitive_pin_calibrate_discharge(const capacitive_pin_t * const pin)
+{
+    const capacitive_threshold_t old_threshold = _threshold;
+    capacitive_threshold_t threshold; // read while searching the discharge
+    uint16_t low, high, middle; // search bounds (thresholds, then ticks)
+
+    if (!(*pin->enabled_mask & pin->pin.bitmask)) // pin not enabled (or does not exists)
+        return;
+#ifdef USE_THRESHOLD_DITHER
+    dither_paused = 1; // Edge shifts are compared with DISCHARGE_TOLERANCE, the dither would hide them
+#endif
+
+    // Edge: shortest window reading no contact, after the longest discharge
+    for (low = 0, high = (uint16_t)THRESHOLD_MAX + 1; low < high;) {
+        middle = low + (high - low) / 2;
+        if (discharge_read(pin, middle, DISCHARGE_TICKS_MAX))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    if ((low > THRESHOLD_MAX) || (low <= DISCHARGE_TOLERANCE)) { // Never charged, or too fast to tell
+        set_discharge_ticks(pin, DISCHARGE_TICKS);
+    } else { // Charge left by a short discharge moves the edge down, shortest one keeping it above tolerance
+        threshold = low - 1 - DISCHARGE_TOLERANCE;
+        for (low = 1, high = DISCHARGE_TICKS_MAX; low < high;) {
+            middle = low + (high - low) / 2;
+            if (discharge_read(pin, threshold, middle))
+                high = middle;
+            else
+                low = middle + 1;
+        }
+        if (low >= DISCHARGE_TICKS_MAX) { // Not settled by the longest discharge, measure is meaningless
+            set_discharge_ticks(pin, DISCHARGE_TICKS);
         } else {
-            waiting = 0; // One pin waiting (well, the 0 might be confusing)
-            last_timer_read = 0;
-            last_pin = pin; // Current pin
-            timer3_compare(TIMER_COMP_A, &timer_comparator); // sets compare A
-            _MemoryBarrier(); // Firs compare, then timer start
-            timer_start(TIMER_ID_3); // Starts the timer and waits for the interrupt
-        } // end if
-    } // end atomic
+            low += ((uint32_t)low * DISCHARGE_MARGIN + 99) / 100; // Rounded up
+            set_discharge_ticks(pin, (low < DISCHARGE_TICKS_MAX) ? low : DISCHARGE_TICKS_MAX);
+        }
+    }
+#ifdef USE_THRESHOLD_DITHER
+    dither_paused = 0;
 #endif
+    set_threshold(old_threshold);
+}
+#endif // USE_DISCHARGE_CALIBRATION
+
+#if defined(USE_PORT_PARALLEL_READ) || defined(USE_CHARGE_TIME)
+// Collects all the enabled pins in pins[start..num) on the same port of pins[start]
+// Their indexes are stored in order, group will contain all their bits. Returns how many they are
+// Collected pins are marked in done (bit j for pins[j])
+static uint8_t port_group(const capacitive_pin_t * const pins[], const uint8_t start, const uint8_t num,
+                          uint32_t * const done, uint8_t order[], capacitive_pin_t * const group) {
+    uint8_t j, len = 0;
+    uint32_t bit;
+
+    *group = *pins[start];
+    group->pin.bitmask = 0;
+    for (j = start, bit = (uint32_t)1 << start; j < num; j++, bit <<= 1) { // collects all the pins on the same port
+        if ((*done & bit) || (pins[j]->port_id != group->port_id)) continue;
+        *done |= bit; // will not be read again
+        if (!(*pins[j]->enabled_mask & pins[j]->pin.bitmask))
+            continue; // pin not enabled (or does not exists), skipped
+        order[len++] = j;
+        group->pin.bitmask |= pins[j]->pin.bitmask;
+    }
 
-    return !!ret_val; // binary return, or 1, or 0
+    if ((len != 0) && (*group->used_mask & group->pin.bitmask))
+        wait_discharge(group); // same as check_port
+
+    return len;
 }
+#endif
 
-// ====== ALL THE 'HARD WORK' IS DONE HERE ======
-// ====== WARNING: DO NOT REMOVE CAP_DISCHARGE(); FUNCTION =====
+#ifdef USE_PORT_PARALLEL_READ
+#define READ_GROUP_STEP (CAPACITIVE_DELAY_OVERHEAD + 10) // cycles between two snapshots of read_group, with no delay
+#define SHOT_DONE  0xFE // shot of a threshold already stored (see capacitive_pins_check)
+#define SHOT_LATER 0xFF // shot of a threshold left to a next pass
+
+// Same as check_port, but reads many pins at once. Pins on the same port are
+// charged all together, then PINx is read once per threshold (ascending order).
+// Bit i of the return value is the result of the read of in[i] (1 contact, 0 not).
+// The same pin may be given more than once, its reads share the charge
+// N.B. a snapshot takes READ_GROUP_STEP cycles, so a threshold closer than that to the previous one
+// is left to another charge of the port (after its discharge). Every read is exact, whatever the
+// thresholds of the other pins are. Equal thresholds share the same snapshot
+uint32_t check_ports(const uint8_t in[], const capacitive_threshold_t thresholds[], const uint8_t num)
+{
+    capacitive_pin_t pins[CAPACITIVE_READS_MAX]; // pins of the current part
+    const capacitive_pin_t * ptrs[CAPACITIVE_READS_MAX];
+    uint8_t i, first, len; // counters
+    uint32_t ret_val = 0;
+
+    for (first = 0; first < num; first += len) { // Parts of CAPACITIVE_READS_MAX pins
+        len = (num - first < CAPACITIVE_READS_MAX) ? num - first : CAPACITIVE_READS_MAX;
+        for (i = 0; i < len; i++) {
+            capacitive_pin_init(pins + i, in[first + i]);
+            ptrs[i] = pins + i;
+        }
+        ret_val |= capacitive_pins_check(ptrs, thresholds + first, len) << first;
+    }
+    return ret_val;
+}
 
-// N.B. _MemoryBarrier function forces r/w to follow the order. It should not slow down execution
-#define CAP_CHARGHE(_pin) do {                                                                                      \
+// capacitive_pins_check of at most CAPACITIVE_READS_MAX reads
+static uint32_t pins_check_part(const capacitive_pin_t * const pins[], const capacitive_threshold_t thresholds[], const uint8_t num)
+{
+    capacitive_pin_t group; // pins of the port currently read
+    uint8_t order[CAPACITIVE_READS_MAX], shot[CAPACITIVE_READS_MAX]; // reads of the port currently read, snapshot of each one
+    uint8_t snapshots[CAPACITIVE_READS_MAX];
+    capacitive_threshold_t delays[CAPACITIVE_READS_MAX]; // delay before each snapshot
+    uint8_t i, j, k, len, shots, left; // counters
+    capacitive_threshold_t elapsed = 0; // window of the previous snapshot
+    uint8_t old_SREG; // to store interrupt configuration
+    uint32_t ret_val = 0, done = 0;
+
+    for (i = 0; i < num; i++) {
+        if (done & ((uint32_t)1 << i)) continue; // Already read
+        len = port_group(pins, i, num, &done, order, &group);
+        if (len == 0) continue; // Nothing to read on this port
+
+        // Insertion sort, by threshold. Ports are small, this is fast enough
+        for (j = 1; j < len; j++)
+            for (k = j; (k > 0) && (thresholds[order[k - 1]] > thresholds[order[k]]); k--) {
+                shots = order[k]; // used as temporany
+                order[k] = order[k - 1];
+                order[k - 1] = shots;
+            }
+
+        memset(shot, SHOT_LATER, len);
+        for (left = len; left != 0;) { // One charge for each pass, until all the thresholds are read
+            // Waiting time between a snapshot and the following one, computed out of the critical section
+            // The first one waits the whole threshold, as the single pin kernels (see CAPACITIVE_WINDOW)
+            shots = 0;
+            for (k = 0; k < len; k++) {
+                if (shot[k] != SHOT_LATER) continue; // Read by a previous pass
+                if ((shots != 0) && (thresholds[order[k]] == elapsed)) { // Same window, same snapshot
+                    shot[k] = shots - 1;
+                    continue;
+                }
+                if (shots == 0)
+#ifdef USE_THRESHOLD_DITHER
+                    delays[shots] = dithered(thresholds[order[k]], dither_next()); // Whole charge is shifted, the steps stay
+#else
+                    delays[shots] = thresholds[order[k]];
+#endif
+                else if (thresholds[order[k]] - elapsed >= READ_GROUP_STEP)
+                    delays[shots] = thresholds[order[k]] - elapsed - READ_GROUP_STEP;
+                else
+                    continue; // Too close to the previous snapshot, next pass
+                elapsed = thresholds[order[k]];
+                shot[k] = shots++;
+            }
+
+            if (left != len)
+                wait_discharge(&group); // Previous pass has just charged the port
+            _MemoryBarrier();
+            old_SREG = SREG; // Stores interrupt configuration
+            SREG = 0; // disables interrupts for a while
+
+            read_group(&group, delays, snapshots, shots); // time critical section, reading (shots is at least 1)
+
+            SREG = old_SREG; // re-enable interrupts (if enabled)
+            schedule_discharge(&group); // whole group is discharged together
+
+            for (k = 0; k < len; k++) { // Now stores the results of this pass
+                if (shot[k] >= SHOT_DONE) continue; // Not in this pass
+                if (!(snapshots[shot[k]] & pins[order[k]]->pin.bitmask)) // pin not charged yet, contact
+                    ret_val |= (uint32_t)1 << order[k];
+                shot[k] = SHOT_DONE;
+                left--;
+            }
+        }
+    }
+
+    return ret_val;
+}
+
+uint32_t capacitive_pins_check(const capacitive_pin_t * const pins[], const capacitive_threshold_t thresholds[], const uint8_t num)
+{
+    uint8_t first, len; // counters
+    uint32_t ret_val = 0;
+
+    for (first = 0; first < num; first += len) { // Scratch arrays hold CAPACITIVE_READS_MAX reads
+        len = (num - first < CAPACITIVE_READS_MAX) ? num - first : CAPACITIVE_READS_MAX;
+        ret_val |= pins_check_part(pins + first, thresholds + first, len) << first;
+    }
+    return ret_val;
+}
+#endif // USE_PORT_PARALLEL_READ
+
+#ifdef USE_CHARGE_TIME
+// Measures the charge time of all the given pins. Pins on the same port are charged together
+// times[i] is the number of polling loops pin in[i] needed to read 1 (CHARGE_TIME_MAX if never)
+void measure_ports(const uint8_t in[], uint8_t times[], const uint8_t num)
+{
+    capacitive_pin_t pins[CAPACITIVE_READS_MAX]; // pins of the current part
+    const capacitive_pin_t * ptrs[CAPACITIVE_READS_MAX];
+    uint8_t i, first, len; // counters
+
+    for (first = 0; first < num; first += len) { // Parts of CAPACITIVE_READS_MAX pins
+        len = (num - first < CAPACITIVE_READS_MAX) ? num - first : CAPACITIVE_READS_MAX;
+        for (i = 0; i < len; i++) {
+            capacitive_pin_init(pins + i, in[first + i]);
+            ptrs[i] = pins + i;
+        }
+        capacitive_pins_measure(ptrs, times + first, len);
+    }
+}
+
+void capacitive_pins_measure(const capacitive_pin_t * const pins[], uint8_t times[], const uint8_t num)
+{
+    capacitive_pin_t group; // pins of the port currently read
+    uint8_t order[CHAR_BIT], counts[CHAR_BIT], states[CHAR_BIT]; // At most 8 pins per port
+    uint8_t i, k, e, len, events; // counters
+#ifdef USE_PCINT_CHARGE_TIME
+    uint8_t tries; // measures of the late PORTB pins
+#endif
+    uint8_t old_SREG; // to store interrupt configuration
+    uint32_t done = 0;
+
+    for (i = 0; i < num; i++)
+        times[i] = CHARGE_TIME_MAX; // Disabled pins, or never charged
+
+#ifdef USE_INPUT_CAPTURE
+    for (i = 0; i < num; i++) { // Capture pin is timed by Timer 1, out of its group
+        if (pins[i]->id != INPUT_CAPTURE_PIN) continue;
+        len = port_group(pins, i, i + 1, &done, order, &group); // Only this pin
+        if (len != 0) {
+            times[i] = icp_measure_pin(group.pin);
+            schedule_discharge(&group);
+        }
+    }
+#endif
+
+    for (i = 0; i < num; i++) {
+        if (done & ((uint32_t)1 << i)) continue; // Already read
+        len = port_group(pins, i, num, &done, order, &group);
+        if (len == 0) continue; // Nothing to read on this port
+
+#ifdef USE_PCINT_CHARGE_TIME
+        if (group.port_id == PIN_PORT_ID_B) { // Timed by interrupts, no busy wait
+            for (tries = 0; ; tries++) { // Late pins are measured again, at most PCINT_RETRIES times
+                pcint_measure_group(group.pin);
+                schedule_discharge(&group); // whole group is discharged together
+                for (k = 0; k < len; k++) // PORTB bit i is stored in pcint_times[i]
+                    for (e = 0; e < CHAR_BIT; e++)
+                        if ((pins[order[k]]->pin.bitmask == _BV(e)) && (group.pin.bitmask & _BV(e)))
+                            times[order[k]] = pcint_times[e];
+                if ((pcint_late == 0) || (tries == PCINT_RETRIES)) break; // The last late times are kept
+                group.pin.bitmask = pcint_late;
+                wait_discharge(&group);
+            }
+            continue;
+        }
+#endif
+        _MemoryBarrier();
+        old_SREG = SREG; // Stores interrupt configuration
+        SREG = 0; // disables interrupts for a while
+
+        events = measure_group(&group, counts, states); // time critical section, measuring
+
+        SREG = old_SREG; // re-enable interrupts (if enabled)
+        schedule_discharge(&group); // whole group is discharged together
+
+        for (k = 0; k < len; k++) // First event where the pin is high is its charge time
+            for (e = 0; e < events; e++)
+                if (states[e] & pins[order[k]]->pin.bitmask) {
+                    times[order[k]] = counts[e];
+                    break;
+                }
+    }
+}
+
+uint8_t measure_port(uint8_t in) {
+    uint8_t time;
+    measure_ports(&in, &time, 1);
+    return time;
+}
+#endif // USE_CHARGE_TIME
+// ====== MEASURING KERNELS, CAP_ MACROS ARE DEFINED ABOVE ======
+
+// Same as CAP_CHARGHE and CAP_DISCHARGHE, but port P is a constant (P is the port letter)
+// The compiler can use in and out instructions, rather than the slower ld and st through pointers
+#define CAP_CHARGHE_PORT(P, bitmask) do {                                                                          \
     _MemoryBarrier();                                                                                               \
-    *(_pin.ddr) &= ~(_pin.bitmask); /* Make the port an input (connect internal resistor) */                        \
+    DDR ## P &= ~(bitmask); /* Make the pins inputs (connect internal resistor) */                                  \
     _MemoryBarrier();                                                                                               \
-    *(_pin.port) |= _pin.bitmask; /* writes 1 on the pin (port is a pull-up). Capacitor charging starts now */      \
+    PORT ## P |= (bitmask); /* Capacitor charging starts now */                                                     \
     _MemoryBarrier();                                                                                               \
 } while (0)
 
-/* Performs the reading */
-#define CAP_READ(_pin) (*(_pin.pin) & _pin.bitmask) //  N.B Keep _pin on the local stack, this way gains in speed
-
-/* discharge port, it is important to leave the pis low if you want to do multiple readings
-   discharge port function should do the same thing on all the pins, but it is safer to do it just after reading */
-#define CAP_DISCHARGHE(_pin) do {                                                                                  \
+#define CAP_DISCHARGHE_PORT(P, bitmask) do {                                                                       \
     _MemoryBarrier(); /* WARNING: Keep the order of the following two */                                            \
-    *(_pin.port) &= ~(_pin.bitmask); /* wirtes 0 */                                                                 \
+    PORT ## P &= ~(bitmask); /* wirtes 0 */                                                                         \
     _MemoryBarrier();                                                                                               \
-    *(_pin.ddr) |= _pin.bitmask; /* port is now an output (disconnect internal resistor) */                         \
+    DDR ## P |= (bitmask); /* pins are now outputs (disconnect internal resistor) */                                \
     _MemoryBarrier();                                                                                               \
 } while (0)
 
-// Actual implementation
-#define CAP_HARD_WORK(pin, delay) do {                                                                              \
-    uint8_t read, _count = _threshold / 3;                                                                          \
-    pin_t temp;  /* Needet to keep a copy of param on local stack. This way gains a faster access */                \
-    memcpy(&temp, &pin, sizeof(pin)); /* DO NOT REMOVE THIS, faster access is necessary for fast reading */         \
-    CAP_CHARGHE(temp);                                                                                              \
-    __builtin_avr_delay_cycles(delay);  /* Waits some nops */                                                       \
-    _delay_loop_1(_count); /* waits the rest of the time. Each loop requires 3 instructions */                      \
-    read = CAP_READ(temp); /* here local stack reduces asm overhead, i.e. overhead is only given by loops */        \
-    CAP_DISCHARGHE(temp);                                                                                           \
-    return !read;                                                                                                   \
-} while (0)
-
-#define CAP_HARD_WORK_NO_LOOP(pin, delay) do {                                                                      \
-    uint8_t read;                                                                                                   \
-    pin_t temp;  /* Needet to keep a copy of param on local stack. This way gains a faster access */                \
-    memcpy(&temp, &pin, sizeof(pin)); /* DO NOT REMOVE THIS, faster access is necessary for fast reading */         \
-    CAP_CHARGHE(pin);                                                                                               \
-    __builtin_avr_delay_cycles(delay);  /* Waits some nops */                                                       \
-    read = CAP_READ(temp); /* here local stack reduces asm overhead, i.e. overhead is only given by loops */        \
-    CAP_DISCHARGHE(pin);                                                                                            \
-    return !read;                                                                                                   \
-} while (0)
-
-// Do not inline the following function !!! They work because the compiler will not mix their code with the rest
-__attribute__((noinline)) static uint8_t hard_work_0(pin_t pin) { CAP_HARD_WORK(pin, 0); }
-__attribute__((noinline)) static uint8_t hard_work_1(pin_t pin) { CAP_HARD_WORK(pin, 1); }
-__attribute__((noinline)) static uint8_t hard_work_2(pin_t pin) { CAP_HARD_WORK(pin, 2); }
-__attribute__((noinline)) static uint8_t hard_work_no_loop_0(pin_t pin) { CAP_HARD_WORK_NO_LOOP(pin, 0); }
-__attribute__((noinline)) static uint8_t hard_work_no_loop_1(pin_t pin) { CAP_HARD_WORK_NO_LOOP(pin, 1); }
-__attribute__((noinline)) static uint8_t hard_work_no_loop_2(pin_t pin) { CAP_HARD_WORK_NO_LOOP(pin, 2); }
-
-// Implements three times the function, each time with a different delay
-static inline // this function may be inlined
-uint8_t check_pin(pin_t pin) {
-    uint8_t read;
-    uint8_t _algorithm = _threshold % 3;
-
-    if (_threshold < 3) { //tis implies (_threshold / 3) == 0, that will cause '_count' starts from 0.
-        // when calling _delay_loop_1 with 0 parameter it will actually loops 256 times
-        // So the solution is to not call the _delay_loop_1 when it will cause a bug
-        if (_algorithm == 0) // Use algorithm 0
-            read = hard_work_no_loop_0(pin);
-        else if (_algorithm == 1) // Yses algorithm 1
-            read = hard_work_no_loop_1(pin);
-        else if (_algorithm == 2) // Yses algorithm 2
-            read = hard_work_no_loop_2(pin);
-    } else {
-        if (_algorithm == 0) // Use algorithm 0
-            read = hard_work_0(pin);
-        else if (_algorithm == 1) // Yses algorithm 1
-            read = hard_work_1(pin);
-        else if (_algorithm == 2) // Yses algorithm 2
-            read = hard_work_2(pin);
+#ifdef USE_CHARGE_TIME
+// Charge time measurement: charges every pin of the group, then polls PINx until all of them
+// read 1 (or CHARGE_TIME_MAX loops). Each time a pin goes high the loop count is stored,
+// states[e] contains the pins high at counts[e]. Returns the number of stored events
+// N.B. a pin read high is considered charged, so there are at most 8 events
+// One kernel for each port, so PINx is read with a single instruction
+#define MEASURE_GROUP_KERNEL(P)                                                                                    \
+__attribute__((noinline))                                                                                          \
+static uint8_t measure_group_ ## P(const uint8_t bitmask, uint8_t * counts, uint8_t * states) {                    \
+    uint8_t count = 0, events = 0, now, last = 0;                                                                   \
+    CAP_CHARGHE_PORT(P, bitmask);                                                                                   \
+    do {                                                                                                            \
+        now = last | (PIN ## P & bitmask); /* pins charged until now */                                             \
+        if (now != last) { /* at least one more pin is charged */                                                   \
+            counts[events] = count;                                                                                 \
+            states[events] = now;                                                                                   \
+            events++;                                                                                               \
+            last = now;                                                                                             \
+        }                                                                                                           \
+    } while ((now != bitmask) && (++count != CHARGE_TIME_MAX));                                                     \
+    CAP_DISCHARGHE_PORT(P, bitmask);                                                                                \
+    return events;                                                                                                  \
+}
+PIN_PORTS_FOREACH(MEASURE_GROUP_KERNEL)
+
+// Calls the kernel of the group port
+static uint8_t measure_group(const capacitive_pin_t * const group, uint8_t * counts, uint8_t * states) {
+    switch (group->port_id) {
+#define MEASURE_GROUP_CASE(P) case PIN_PORT_ID_ ## P: return measure_group_ ## P(group->pin.bitmask, counts, states);
+        PIN_PORTS_FOREACH(MEASURE_GROUP_CASE)
+#undef MEASURE_GROUP_CASE
+        default: return 0; // Not a capacitive port, nothing measured
     }
-
-    return read;
 }
+#endif // USE_CHARGE_TIME
+
+#ifdef USE_PORT_PARALLEL_READ
+// Port parallel version: charges every pin of the group, then takes one snapshot of PINx
+// after each delays[k] + READ_GROUP_STEP cycles (the first after delays[0] + CAPACITIVE_WINDOW_OFFSET,
+// as the single pin kernels). The whole loop is asm, so each snapshot costs exactly the same
+// Snapshots are analyzed by the caller. len must not be 0
+// Do not inline, as the functions above it must not be mixed with the rest of the code
+#define READ_GROUP_KERNEL(P)                                                                                       \
+__attribute__((noinline))                                                                                          \
+static void read_group_ ## P(const uint8_t bitmask, const capacitive_threshold_t * delays,                         \
+                             uint8_t * snapshots, uint8_t len) {                                                   \
+    uint8_t on; /* Pull-up value, computed before the window */                                                    \
+    capacitive_threshold_t cycles;                                                                                  \
+    _MemoryBarrier();                                                                                               \
+    DDR ## P &= ~(bitmask); /* Make the pins inputs (connect internal resistor) */                                  \
+    on = PORT ## P | (bitmask);                                                                                     \
+    __asm__ __volatile__ (                                                                                          \
+        "out %[port], %[on]"                "\n\t" /* Capacitor charging starts now */                            \
+        "1: ld %A[cycles], %a[delays]+"     "\n\t" /* 4 cycles */                                                 \
+        "ld %B[cycles], %a[delays]+"        "\n\t"                                                                \
+        CAPACITIVE_DELAY_ASM                                                                                        \
+        "in __tmp_reg__, %[pin]"            "\n\t" /* One read for all the pins of the port */                    \
+        "st %a[snapshots]+, __tmp_reg__"    "\n\t" /* 5 cycles, with the loop */                                  \
+        "dec %[len]"                        "\n\t"                                                                \
+        "brne 1b"                           "\n\t"                                                                \
+        : [delays] "+e" (delays), [snapshots] "+e" (snapshots), [len] "+r" (len), [cycles] "=&w" (cycles)         \
+        : [port] "I" (_SFR_IO_ADDR(PORT ## P)), [pin] "I" (_SFR_IO_ADDR(PIN ## P)), [on] "r" (on)                   \
+        : "r0", "memory");                                                                                          \
+    CAP_DISCHARGHE_PORT(P, bitmask);                                                                                \
+}
+PIN_PORTS_FOREACH(READ_GROUP_KERNEL)
+
+// Calls the kernel of the group port
+static void read_group(const capacitive_pin_t * const group, const capacitive_threshold_t * delays, uint8_t * snapshots, uint8_t len) {
+    switch (group->port_id) {
+#define READ_GROUP_CASE(P) case PIN_PORT_ID_ ## P: read_group_ ## P(group->pin.bitmask, delays, snapshots, len); break;
+        PIN_PORTS_FOREACH(READ_GROUP_CASE)
+#undef READ_GROUP_CASE
+        default: memset(snapshots, 0xff, len); // Not a capacitive port, reads as charged (no contact)
+    }
+}
+#else // USE_PORT_PARALLEL_READ not defined
+
+// Generic version, for pins without a kernel: one kernel for each port, the bitmask is a parameter
+// Same window of the single pin kernels (see CAPACITIVE_WINDOW)
+// Do not inline the following functions !!! They work because the compiler will not mix their code with the rest
+#define CHECK_PORT_KERNEL(P)                                                                                        \
+__attribute__((noinline))                                                                                          \
+static uint8_t check_port_ ## P(const uint8_t bitmask, capacitive_threshold_t threshold) {                         \
+    uint8_t read, on;                                                                                               \
+    _MemoryBarrier();                                                                                               \
+    DDR ## P &= ~(bitmask); /* Make the pin an input (connect internal resistor) */                                 \
+    on = PORT ## P | (bitmask); /* Pull-up value, computed before the window */                                    \
+    CAPACITIVE_WINDOW(PORT ## P, PIN ## P, on, threshold, read);                                                    \
+    CAP_DISCHARGHE_PORT(P, bitmask);                                                                                \
+    return !(read & (bitmask));                                                                                     \
+}
+PIN_PORTS_FOREACH(CHECK_PORT_KERNEL)
+
+// Calls the kernel of the pin port
+static uint8_t check_pin(const capacitive_pin_t * const pin, capacitive_threshold_t threshold) {
+    switch (pin->port_id) {
+#define CHECK_PORT_CASE(P) case PIN_PORT_ID_ ## P: return check_port_ ## P(pin->pin.bitmask, threshold);
+        PIN_PORTS_FOREACH(CHECK_PORT_CASE)
+#undef CHECK_PORT_CASE
+        default: return 0; // Not a capacitive port, reads as charged (no contact)
+    }
+}
+
+#endif // USE_PORT_PARALLEL_READ
@@ -62,3 +62,68 @@ void circular_buffer_push(struct _circular_buffer_t * const buf, const uint8_t n
 circular_buffer_sum_t circular_buffer_sum(const struct _circular_buffer_t * const buf) {
     return buf->sum;
 }
+
+void history_reset(struct _history_t * const hist) {
+    uint8_t i; // counter
+
+    hist->bits = 0;
+    hist->sum = hist->fast_sum = 0;
+    for (i = 0; i < HISTORY_LEN; i++) // Same pattern of circular_buffer_reset
+        history_push(hist, i % 2);
+}
+
+circular_buffer_sum_t history_recent_sum(const struct _history_t * const hist, const uint8_t len) {
+    if (len >= HISTORY_LEN) return hist->sum; // Kept updated
+#if HISTORY_LEN == 64
+    return __builtin_popcountll(hist->bits & (((history_word_t)1 << len) - 1)); // Newest len bits
+#else
+    return __builtin_popcountl(hist->bits & (((history_word_t)1 << len) - 1)); // Newest len bits
+#endif
+}
+
+void sample_ring_reset(struct _sample_ring_t * const ring) {
+    memset(ring->data, 0, ring->len*sizeof*(ring->data)); // Samples not pushed yet are 0s
+    ring->pos = 0;
+    ring->count = 0;
+    ring->sum = ring->sum_sq = 0;
+}
+
+void sample_ring_init(struct _sample_ring_t * const ring, sample_ring_data_t * data, const uint16_t len) {
+    ring->len = len;
+    ring->data = data;
+    sample_ring_reset(ring);
+}
+
+void sample_ring_push(struct _sample_ring_t * const ring, const sample_ring_data_t new_data) {
+    const sample_ring_data_t old_data = ring->data[ring->pos]; // 0 while the ring is filling
+
+    ring->sum    += new_data; // Adds new data before subtracting, sums are unsigned
+    ring->sum    -= old_data;
+    ring->sum_sq += (sample_ring_sum_t)new_data * new_data;
+    ring->sum_sq -= (sample_ring_sum_t)old_data * old_data;
+    ring->data[ring->pos] = new_data;
+    if (ring->count < ring->len)
+        (ring->count)++;
+    (ring->pos)++; // Increases the pointer
+    if (ring->pos >= ring->len)
+        ring->pos = 0; // Resets when pos reaches the end
+}
+
+sample_ring_data_t sample_ring_mean(const struct _sample_ring_t * const ring) {
+    if (ring->count == 0) return 0;
+    return ring->sum / ring->count;
+}
+
+// count^2*variance = count*(sum_sq - q*(q*count + 2*r)) - r^2, with sum = q*count + r. The first
+// term never exceeds sum_sq, so the sums type never overflows and the result is rounded exactly
+sample_ring_sum_t sample_ring_variance(const struct _sample_ring_t * const ring) {
+    sample_ring_sum_t q, r, a; // quotient and remainder of the mean, count times the variance (about)
+
+    if (ring->count == 0) return 0;
+    q = ring->sum / ring->count;
+    r = ring->sum % ring->count;
+    a = ring->sum_sq - q*(q*ring->count + 2*r);
+    if ((a % ring->count)*ring->count < r*r) // The fraction left is negative, both terms are below count^2
+        return a / ring->count - 1;
+    return a / ring->count;
+}
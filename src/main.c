@@ -163,9 +163,24 @@ void main_loop(capacitive_sensor_t * sensors) {
     _MemoryBarrier();
 }
 
+#if defined(USE_INPUT_CAPTURE) // Timer 1 must count cpu cycles to capture charge times
+#    define TICK_SOURCE    TIMER_SOURCE_CLK
+#    define TICK_PRESCALER 1.0
+#elif defined(USE_STREAMING_SAMPLER) // Needs a finer timer to spread readings along the tick
+#    define TICK_SOURCE    TIMER_SOURCE_CLK_64
+#    define TICK_PRESCALER 64.0
+#else
+#    define TICK_SOURCE    TIMER_SOURCE_CLK_1024
+#    define TICK_PRESCALER 1024.0
+#endif
+_Static_assert((double)F_CPU/SAMPLES_PER_SECOND/TICK_PRESCALER < 65536.0, "SAMPLES_PER_SECOND too low for Timer 1");
+#ifdef USE_SPRT // The capacitive code cannot see config.h, the rate is repeated in the settings
+_Static_assert(SPRT_READS_PER_SECOND == (double)SAMPLES_PER_SECOND*SAMPLES_NUM, "SPRT_READS_PER_SECOND must be SAMPLES_PER_SECOND*SAMPLES_NUM");
+#endif
+
 int main(void) {
-    uint16_t timer_comparator = ((double)F_CPU/SAMPLES_PER_SECOND)/1024.0; // 1024 = clock prescaler
-    capacitive_sensor_t sensors[inputs_len]; // One for each input
+    uint16_t timer_comparator = ((double)F_CPU/SAMPLES_PER_SECOND)/TICK_PRESCALER; // clock prescaler
+    capacitive_sensor_t sensors[sizeof(inputs)/sizeof(*inputs)]; // One for each input, fixed size (no VLA)
 
     cli();
     power_all_disable(); // Disables every device (saving power)
@@ -173,24 +188,11 @@ int main(void) {
     if (get_free_ram() <= 2048) // If static variables uses too mutch memory
         fatal_error(); // Making the execution going on might have unfunny consequences  
 
-    // Now does all the initializations
-    __USB_power_enable(); // Switches on USB
-    __USB_init(); // Automatically do all the needed to init usb
-#ifdef USE_PROGMEM
-    capacitive_sensor_inits_P(sensors, inputs, inputs_len); // Calls the PROGMEM version
-#else
-    capacitive_sensor_inits(sensors, inputs, inputs_len); // Calls the npn-PROGMEM version
-#endif
-
-    ARDUINO_LED_INIT(); // sets Arduino LED as output
-    _MemoryBarrier(); // Forces executing r/w ops in order
-    
-    cli();
-
     // Now configures and starts the timer
+    // It is started before the sensors, input capture calibration needs Timer 1 running
     timer_enable(TIMER_ID_1); // enables the timer, this way it can start when done
     timer_init(TIMER_ID_1, // Timer settings
-               TIMER_SOURCE_CLK_1024, // Sets cpu clock / 1024 tick frequency
+               TICK_SOURCE, // Sets cpu clock / TICK_PRESCALER tick frequency
                TIMER_MODE_CTC_OCR, // When reaches Compare A resets
                OUT_MODE_NORMAL_A | OUT_MODE_NORMAL_B); // Not used output
     timer_init_interrupt(TIMER_ID_1, TIMER_INTERRUPT_MODE_OCIA); // This enables interrupt, on compare A
@@ -206,6 +208,22 @@ int main(void) {
         fatal_error();
     }
 
+    // Now does all the initializations
+    __USB_power_enable(); // Switches on USB
+    __USB_init(); // Automatically do all the needed to init usb
+#ifdef USE_PROGMEM
+    capacitive_sensor_inits_P(sensors, inputs, inputs_len); // Calls the PROGMEM version
+#else
+    capacitive_sensor_inits(sensors, inputs, inputs_len); // Calls the npn-PROGMEM version
+#endif
+
+    ARDUINO_LED_INIT(); // sets Arduino LED as output
+    _MemoryBarrier(); // Forces executing r/w ops in order
+    
+#ifdef USE_STREAMING_SAMPLER
+    capacitive_sampler_start(sensors, inputs_len); // From now on readings are done in background
+#endif
+
     sei(); // Re-enables interrupts
     
     _MemoryBarrier();
@@ -74,3 +74,11 @@ pin_t id_to_pin(uint8_t id) {
 
     return ret_val;
 }
+
+/* Index of the port of the pin, the same of PIN_PORTS_FOREACH order */
+uint8_t pin_port_id(const pin_t pin) {
+#define PIN_PORT_ID_CHECK(P) if (pin.port == &PORT ## P) return PIN_PORT_ID_ ## P;
+    PIN_PORTS_FOREACH(PIN_PORT_ID_CHECK)
+#undef PIN_PORT_ID_CHECK
+    return PIN_PORTS_NUM; // Non standard pins
+}
@@ -0,0 +1,75 @@
+/*
+    DanceTuxTux Board Project
+    Copyright (C) 2016  Serraino Alessio
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h> // memset
+#include "sliced_history.h"
+
+void sliced_history_reset(struct _sliced_history_t * const hist) {
+    uint8_t i; // counter
+
+    memset(hist, 0, sizeof(*hist)); // All the sums are 0, as the samples
+    for (i = 0; i < SLICED_HISTORY_LEN; i++) // Same pattern of circular_buffer_reset, in all the lanes
+        sliced_history_push(hist, (i % 2) ? 0xFF : 0x00, 0xFF);
+}
+
+void sliced_history_push(struct _sliced_history_t * const hist, uint8_t new_data, const uint8_t mask) {
+    const uint8_t old_data = hist->samples[hist->pos];
+    uint8_t carry, borrow, temp; // lanes to increase and to decrease
+    uint8_t j; // counter through planes
+
+    new_data = (new_data & mask) | (old_data & ~mask); // Lanes out of mask get back their old sample
+    hist->samples[hist->pos] = new_data;
+    (hist->pos)++;
+    if (hist->pos >= SLICED_HISTORY_LEN)
+        hist->pos = 0; // Resets when pos reaches the end
+
+    carry  = new_data & ~old_data; // 1 in, 0 out: sum + 1
+    borrow = old_data & ~new_data; // 0 in, 1 out: sum - 1
+    for (j = 0; (j < SLICED_HISTORY_PLANES) && (carry | borrow); j++) { // Ripple adder, one bit for each lane
+        temp = hist->planes[j];
+        hist->planes[j] ^= carry | borrow; // a lane is never increased and decreased together
+        carry  &= temp;
+        borrow &= ~temp;
+    }
+}
+
+uint8_t sliced_history_at_least(const struct _sliced_history_t * const hist, const uint8_t value) {
+    uint8_t greater = 0, equal = 0xFF; // Lanes already greater than value, lanes equal up to this plane
+    uint8_t j; // counter through planes
+
+    if ((value >> (SLICED_HISTORY_PLANES - 1)) >> 1) // Greater than any sum (two shifts, planes may be 8)
+        return 0;
+    for (j = SLICED_HISTORY_PLANES; j-- > 0; ) { // From the most significant bit
+        if (value & (1 << j)) {
+            equal &= hist->planes[j];
+        } else {
+            greater |= equal & hist->planes[j];
+            equal &= ~hist->planes[j];
+        }
+    }
+    return greater | equal;
+}
+
+uint8_t sliced_history_sum(const struct _sliced_history_t * const hist, const uint8_t lane) {
+    uint8_t sum = 0;
+    uint8_t j; // counter through planes
+
+    for (j = 0; j < SLICED_HISTORY_PLANES; j++)
+        sum |= ((hist->planes[j] >> lane) & 1) << j;
+    return sum;
+}
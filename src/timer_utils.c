@@ -31,6 +31,7 @@
 #include "timer_utils.h" // timer defines
 
 #include <avr/power.h> // power enable/disable timers
+#include <avr/interrupt.h> // ISR macro
 
 // This function works as follow:
 // For each bit, if relative bitmask bit is 1 then is set to first not used new_val
@@ -417,6 +418,45 @@ void timer3_init_interrupt(const uint8_t interrupt_mode_switch) {
     else        TIMSK3 &= ~(_BV(TOIE3)); // clear bit
 }
 
+static inline
+void timer1_init_capture(const uint8_t capture_mode) {
+    // bit    |   7      6      5      4      3      2      1      0
+    // field  | ICNC1  ICES1  ------  WGM13 WGM12  CS12   CS11   CS10     TCCR1B
+    if (capture_mode & TIMER_CAPTURE_RISING & ~TIMER_CAPTURE_FALLING) // Rising edge
+                TCCR1B |= _BV(ICES1); // set bit
+    else        TCCR1B &= ~(_BV(ICES1)); // clear bit
+    if (capture_mode & TIMER_CAPTURE_NOISE_CANCEL & ~TIMER_CAPTURE_FALLING) // Noise canceler
+                TCCR1B |= _BV(ICNC1); // set bit
+    else        TCCR1B &= ~(_BV(ICNC1)); // clear bit
+}
+
+static inline // This is exactly as Timer1
+void timer3_init_capture(const uint8_t capture_mode) {
+    // bit    |   7      6      5      4      3      2      1      0
+    // field  | ICNC3  ICES3  ------  WGM33 WGM32  CS32   CS31   CS30     TCCR3B
+    if (capture_mode & TIMER_CAPTURE_RISING & ~TIMER_CAPTURE_FALLING) // Rising edge
+                TCCR3B |= _BV(ICES3); // set bit
+    else        TCCR3B &= ~(_BV(ICES3)); // clear bit
+    if (capture_mode & TIMER_CAPTURE_NOISE_CANCEL & ~TIMER_CAPTURE_FALLING) // Noise canceler
+                TCCR3B |= _BV(ICNC3); // set bit
+    else        TCCR3B &= ~(_BV(ICNC3)); // clear bit
+}
+
+// Capture handlers, called by the capture ISRs
+volatile static // Accessible only in this code. They are accessed in ISR
+timer_capture_handler_t timer1_capture_handler = NULL,
+                        timer3_capture_handler = NULL;
+
+ISR(TIMER1_CAPT_vect) {
+    if (timer1_capture_handler != NULL)
+        timer1_capture_handler(ICR1);
+}
+
+ISR(TIMER3_CAPT_vect) {
+    if (timer3_capture_handler != NULL)
+        timer3_capture_handler(ICR3);
+}
+
 static inline
 void timer0_force_start(void) {
     uint16_t new_bits; // Holds 3 bits, one per nibble (improves readability)
@@ -598,6 +638,24 @@ void timer_init_interrupt(const uint8_t timer_id, const uint8_t interrupt_mode)
     }
 }
 
+void timer_init_capture(const uint8_t timer_id, const uint8_t capture_mode) {
+    switch (timer_id) { // Timer 0 has no input capture unit
+        case TIMER_ID_1:
+            timer1_init_capture(capture_mode);
+            break;
+        case TIMER_ID_3:
+            timer3_init_capture(capture_mode);
+            break;
+    }
+}
+
+void timer_capture_handler(const uint8_t timer_id, const timer_capture_handler_t handler) {
+    if (timer_id == TIMER_ID_1)
+        timer1_capture_handler = handler;
+    else if (timer_id == TIMER_ID_3)
+        timer3_capture_handler = handler;
+}
+
 uint8_t timer_start(uint8_t timer_id)
 {
     if (is_timer_running(timer_id)) // Timer is already going
@@ -704,10 +762,12 @@ uint8_t timer0_compare(const uint8_t comp_id, const uint8_t new_val[]) {
     uint8_t old_comp = 0;
     if (comp_id == TIMER_COMP_A) {
         old_comp = OCR0A;
-        OCR0A = new_val[0];
+        if (new_val)
+            OCR0A = new_val[0];
     } else if (comp_id == TIMER_COMP_B) {
         old_comp = OCR0B;
-        OCR0B = new_val[0];
+        if (new_val)
+            OCR0B = new_val[0];
     }
     return old_comp;
 }
@@ -716,16 +776,20 @@ uint16_t timer1_compare(const uint8_t comp_id, const uint16_t new_val[]) {
     uint16_t old_comp = 0;
     if (comp_id == TIMER_COMP_A) {
         old_comp = OCR1A;
-        OCR1A = new_val[0];
+        if (new_val)
+            OCR1A = new_val[0];
     } else if (comp_id == TIMER_COMP_B) {
         old_comp = OCR1B;
-        OCR1B = new_val[0];
+        if (new_val)
+            OCR1B = new_val[0];
     } else if (comp_id == TIMER_COMP_C) {
         old_comp = OCR1C;
-        OCR1C = new_val[0];
+        if (new_val)
+            OCR1C = new_val[0];
     } else if (comp_id == TIMER_COMP_ICR) {
         old_comp = ICR1;
-        ICR1 = new_val[0];
+        if (new_val)
+            ICR1 = new_val[0];
     }
     return old_comp;
 }
@@ -734,16 +798,32 @@ uint16_t timer3_compare(const uint8_t comp_id, const uint16_t new_val[]) {
     uint16_t old_comp = 0;
     if (comp_id == TIMER_COMP_A) {
         old_comp = OCR3A;
-        OCR3A = new_val[0];
+        if (new_val)
+            OCR3A = new_val[0];
     } else if (comp_id == TIMER_COMP_B) {
         old_comp = OCR3B;
-        OCR3B = new_val[0];
+        if (new_val)
+            OCR3B = new_val[0];
     } else if (comp_id == TIMER_COMP_C) {
         old_comp = OCR3C;
-        OCR3C = new_val[0];
+        if (new_val)
+            OCR3C = new_val[0];
     } else if (comp_id == TIMER_COMP_ICR) {
         old_comp = ICR3;
-        ICR3 = new_val[0];
+        if (new_val)
+            ICR3 = new_val[0];
     }
     return old_comp;
 }
+
+// ===============================================
+// ===== get last captured counter (ICRn)   ======
+// ===============================================
+
+uint16_t timer1_capture(void) {
+    return ICR1;
+}
+
+uint16_t timer3_capture(void) {
+    return ICR3;
+}